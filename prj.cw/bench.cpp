@@ -0,0 +1,368 @@
+// Микробенчмарк решателей: water_filling(), incre_filling(), removeShadowWaterFilling() и
+// ShadowRemovalEngine::process() на синтетических страницах и образцах при разных размерах и k.
+// Результат - JSON; --compare сравнивает его с прошлым запуском и ищет регрессии.
+#include "water_filling.h"
+#include "solver_options.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <thread>
+
+using json = nlohmann::json;
+
+struct BenchInput {
+    std::string name;
+    cv::Mat bgr;
+};
+
+struct BenchOptions {
+    std::vector<cv::Size> sizes{{640, 480}, {1600, 1200}, {3200, 2400}};
+    std::vector<float> rates{0.2f, 0.1f};
+    std::vector<std::string> functions{"water_filling", "incre_filling", "removeShadowWaterFilling", "engine"};
+    int repeats = 3;
+    // размер пакета для "batch" (removeShadowWaterFilling над вектором копий входа)
+    int batch = 8;
+    fs::path out = "bench.json";
+    std::string label;
+    fs::path compare;
+    double threshold = 0.1;
+};
+
+// Синтетическая страница: строки "текста" на светлом фоне с плавным градиентом и тенью
+// с размытым краем. Детерминирована, поэтому замеры разных версий сравнимы.
+cv::Mat synthetic_page(const cv::Size size) {
+    cv::Mat page(size, CV_8UC3);
+    const double cx = size.width * 0.35, cy = size.height * 0.55;
+    const double radius = std::min(size.width, size.height) * 0.3;
+    const int line = std::max(8, size.height / 40);
+    for (int y = 0; y < page.rows; y++) {
+        uchar* row = page.ptr<uchar>(y);
+        const bool text_row = y % line > line / 2 && y % line < line * 3 / 4;
+        for (int x = 0; x < page.cols; x++) {
+            const double d = std::hypot(x - cx, y - cy) / radius;
+            const double shadow = 1 - 0.5 * std::clamp(1.5 - d, 0.0, 1.0);
+            const bool ink = text_row && (x / std::max(4, line / 2)) % 5 != 4 && (x * 7 + y * 3) % 11 < 8;
+            const double paper = 205 + 30.0 * x / page.cols - 10.0 * y / page.rows;
+            const double v = (ink ? 40 : paper) * shadow;
+            row[3 * x] = cv::saturate_cast<uchar>(v * 0.95);
+            row[3 * x + 1] = cv::saturate_cast<uchar>(v);
+            row[3 * x + 2] = cv::saturate_cast<uchar>(v * 1.05);
+        }
+    }
+    return page;
+}
+
+// Первый прогон выделяет память и разогревает пул потоков и в замер не входит
+template <class Body>
+std::vector<double> measure(const int repeats, SolverStats& stats, Body body) {
+    body(stats);
+    std::vector<double> seconds;
+    for (int r = 0; r < repeats; r++) {
+        stats = SolverStats{};
+        StageTimer timer;
+        body(stats);
+        seconds.push_back(timer.lap().wall);
+    }
+    return seconds;
+}
+
+// pixel_iterations - число обновлений ячеек сетки за вызов, bytes - оценка трафика памяти
+// итераций решателей (SolverStats::*_bytes_per_iteration); однократные проходы в ней не учтены
+json record(const std::string& function, const BenchInput& input, const float rate, const cv::Size grid,
+            const int wf_iterations, const int if_iterations, const double pixel_iterations, const double bytes,
+            std::vector<double> seconds) {
+    std::sort(seconds.begin(), seconds.end());
+    const double median = seconds[seconds.size() / 2];
+    json r = {
+        {"function", function},
+        {"input", input.name},
+        {"width", input.bgr.cols},
+        {"height", input.bgr.rows},
+        {"rate", rate},
+        {"grid_width", grid.width},
+        {"grid_height", grid.height},
+        {"wf_iterations", wf_iterations},
+        {"if_iterations", if_iterations},
+        {"repeats", seconds.size()},
+        {"median_sec", median},
+        {"min_sec", seconds.front()},
+        {"ns_per_pixel", median * 1e9 / input.bgr.total()},
+        {"ns_per_pixel_iteration", pixel_iterations > 0 ? json(median * 1e9 / pixel_iterations) : json()},
+        {"bandwidth_gbs", bytes > 0 ? json(bytes / median * 1e-9) : json()},
+    };
+    return r;
+}
+
+std::vector<json> bench_input(const BenchInput& input, const float rate, const WaterFillingParams& params,
+                              const BenchOptions& options) {
+    const auto enabled = [&options](const std::string& function) {
+        return std::find(options.functions.begin(), options.functions.end(), function) != options.functions.end();
+    };
+
+    // входы решателей - как в ShadowRemovalEngine::process()
+    cv::Mat Y;
+    cv::cvtColor(input.bgr, Y, cv::COLOR_BGR2GRAY);
+    const cv::Size grid(cv::saturate_cast<int>(Y.cols * static_cast<double>(rate)),
+                        cv::saturate_cast<int>(Y.rows * static_cast<double>(rate)));
+    cv::Mat Y_down;
+    cv::resize(Y, Y_down, grid, 0, 0, cv::INTER_LINEAR);
+    Y_down.convertTo(Y_down, CV_32F);
+    const double full = static_cast<double>(Y.total());
+    const double low = grid.area();
+
+    std::vector<json> results;
+    SolverStats stats;
+    cv::Mat wf_out;
+    if (enabled("water_filling") || enabled("incre_filling")) {
+        const std::vector<double> seconds = measure(options.repeats, stats, [&](SolverStats& s) {
+            wf_out = water_filling(Y_down, Y.size(), fs::path(), params, &s);
+        });
+        // с пирамидой (--wf-levels) время грубых уровней входит в замер, но не в число итераций
+        const double bytes = stats.wf_bytes_per_iteration * (stats.wf_iterations + stats.wf_coarse_iterations);
+        if (enabled("water_filling")) {
+            results.push_back(record("water_filling", input, rate, grid, stats.wf_iterations, 0,
+                                     low * stats.wf_iterations, bytes, seconds));
+        }
+    }
+    if (enabled("incre_filling")) {
+        const std::vector<double> seconds = measure(options.repeats, stats, [&](SolverStats& s) {
+            incre_filling(wf_out, Y, fs::path(), params, &s);
+        });
+        results.push_back(record("incre_filling", input, rate, Y.size(), 0, stats.if_iterations,
+                                 full * stats.if_iterations, stats.if_bytes_per_iteration * stats.if_iterations,
+                                 seconds));
+    }
+
+    const auto whole = [&](const std::string& function, const std::vector<double>& seconds) {
+        const double if_grid = params.if_low_res ? low : full;
+        results.push_back(record(function, input, rate, grid, stats.wf_iterations, stats.if_iterations,
+                                 low * stats.wf_iterations + if_grid * stats.if_iterations,
+                                 stats.wf_bytes_per_iteration * (stats.wf_iterations + stats.wf_coarse_iterations) +
+                                     stats.if_bytes_per_iteration * stats.if_iterations,
+                                 seconds));
+    };
+    if (enabled("removeShadowWaterFilling")) {
+        whole("removeShadowWaterFilling", measure(options.repeats, stats, [&](SolverStats& s) {
+            removeShadowWaterFilling(input.bgr, rate, fs::path(), params, &s);
+        }));
+    }
+    if (enabled("engine")) {
+        // буферы движка живут между повторами, как в пакетной обработке main_cw
+        ShadowRemovalEngine engine(params);
+        whole("engine", measure(options.repeats, stats, [&](SolverStats& s) {
+            engine.process(input.bgr, rate, fs::path(), &s);
+        }));
+    }
+    if (enabled("batch")) {
+        // время и работа - на одно изображение пакета
+        const std::vector<cv::Mat> batch(options.batch, input.bgr);
+        std::vector<SolverStats> batch_stats;
+        std::vector<double> seconds = measure(options.repeats, stats, [&](SolverStats& s) {
+            removeShadowWaterFilling(batch, rate, params, &batch_stats);
+            s = batch_stats.front();
+        });
+        for (double& sec : seconds) {
+            sec /= options.batch;
+        }
+        whole("batch", seconds);
+    }
+    return results;
+}
+
+std::string result_key(const json& r) {
+    std::ostringstream key;
+    key << r.at("function").get<std::string>() << " " << r.at("input").get<std::string>() << " k="
+        << std::lround(1 / r.at("rate").get<double>());
+    return key.str();
+}
+
+// Сравнение медиан с прошлым JSON; true - есть замедление больше threshold
+bool compare_results(const json& current, const fs::path& baseline_path, const double threshold) {
+    std::ifstream in(baseline_path);
+    if (!in.is_open()) {
+        throw std::runtime_error("Unable to open " + baseline_path.string());
+    }
+    json baseline;
+    in >> baseline;
+    std::map<std::string, double> before;
+    for (const json& r : baseline.at("results")) {
+        before[result_key(r)] = r.at("median_sec").get<double>();
+    }
+
+    bool regression = false;
+    std::cout << "\ncompared with " << baseline_path.string();
+    if (baseline.contains("label") && !baseline["label"].get<std::string>().empty()) {
+        std::cout << " (" << baseline["label"].get<std::string>() << ")";
+    }
+    std::cout << ":\n";
+    for (const json& r : current.at("results")) {
+        const std::string key = result_key(r);
+        const auto it = before.find(key);
+        if (it == before.end()) {
+            continue;
+        }
+        const double change = r.at("median_sec").get<double>() / it->second - 1;
+        const bool slower = change > threshold;
+        regression = regression || slower;
+        std::cout << std::left << std::setw(48) << key << std::right << std::showpos << std::fixed
+                  << std::setprecision(1) << std::setw(8) << change * 100 << "%" << std::noshowpos
+                  << (slower ? "  REGRESSION" : "") << "\n";
+    }
+    return regression;
+}
+
+std::vector<std::string> split(const std::string& value) {
+    std::vector<std::string> out;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            out.push_back(item);
+        }
+    }
+    return out;
+}
+
+int main(const int argc, char** argv) {
+    BenchOptions options;
+    WaterFillingParams params;
+    std::vector<fs::path> images;
+    try {
+        for (int a = 1; a < argc; a++) {
+            const std::string arg = argv[a];
+            if (arg.rfind("--", 0) != 0) {
+                images.emplace_back(arg);
+                continue;
+            }
+            const size_t eq = arg.find('=');
+            const std::string key = arg.substr(0, eq);
+            const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            if (key == "--sizes") {
+                options.sizes.clear();
+                for (const std::string& item : split(value)) {
+                    const size_t x = item.find('x');
+                    if (x == std::string::npos) {
+                        throw std::invalid_argument("size must be WxH: " + item);
+                    }
+                    options.sizes.emplace_back(std::stoi(item.substr(0, x)), std::stoi(item.substr(x + 1)));
+                }
+            } else if (key == "--rates") {
+                options.rates.clear();
+                for (const std::string& item : split(value)) {
+                    options.rates.push_back(std::stof(item));
+                }
+            } else if (key == "--functions") {
+                options.functions = split(value);
+            } else if (key == "--batch") {
+                options.batch = std::max(1, std::stoi(value));
+            } else if (key == "--repeats") {
+                options.repeats = std::max(1, std::stoi(value));
+            } else if (key == "--out") {
+                options.out = value;
+            } else if (key == "--label") {
+                options.label = value;
+            } else if (key == "--compare") {
+                options.compare = value;
+            } else if (key == "--threshold") {
+                options.threshold = std::stod(value);
+            } else if (!parse_solver_option(key, value, params)) {
+                throw std::invalid_argument("unknown option " + arg);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n"
+                  << "Usage: bench_cw [--sizes=640x480,1600x1200] [--rates=0.2,0.1] [--repeats=N]"
+                     " [--functions=water_filling,incre_filling,removeShadowWaterFilling,engine,batch] [--batch=N]"
+                     " [--out=bench.json] [--label=TEXT] [--compare=old.json] [--threshold=0.1]"
+                     " [solver options, e.g. --threads=4] [sample images...]"
+                  << std::endl;
+        return -1;
+    }
+
+    std::vector<BenchInput> inputs;
+    for (const cv::Size& size : options.sizes) {
+        inputs.push_back({"synthetic_" + std::to_string(size.width) + "x" + std::to_string(size.height),
+                          synthetic_page(size)});
+    }
+    for (const fs::path& image : images) {
+        cv::Mat bgr = cv::imread(image.string(), cv::IMREAD_COLOR);
+        if (bgr.empty()) {
+            std::cerr << "Unable to read " << image.string() << std::endl;
+            return -1;
+        }
+        inputs.push_back({image.filename().string(), bgr});
+    }
+
+    json report = {
+        {"label", options.label},
+        {"opencv", cv::getVersionString()},
+        {"kernel_isa", kernel_isa()},
+        {"avx2", std::string(kernel_isa()) == "avx2"},
+        {"hardware_threads", std::thread::hardware_concurrency()},
+        {"params", {
+            {"kernel", params.kernel == WfKernel::Scalar ? "scalar" : "simd"},
+            {"threads", params.threads},
+            {"precision", params.precision == StatePrecision::Q8_8 ? "q8" : "f32"},
+            {"neta", params.neta},
+            {"brightness", params.brightness},
+            {"wf_iterations", params.wf_iterations},
+            {"if_iterations", params.if_iterations},
+            {"if_solver", params.if_solver == IfSolver::Adi ? "adi" : "explicit"},
+            {"if_adi_steps", params.if_adi_steps},
+            {"wf_tolerance", params.wf_tolerance},
+            {"if_tolerance", params.if_tolerance},
+            {"wf_levels", params.wf_levels},
+            {"wf_refine_iterations", params.wf_refine_iterations},
+            {"if_low_res", params.if_low_res},
+            {"warm_start", params.warm_start},
+            {"wf_warm_iterations", params.wf_warm_iterations},
+            {"if_warm_iterations", params.if_warm_iterations},
+            {"time_block", params.time_block},
+            {"cache_bytes", params.cache_bytes},
+            {"tile_size", params.tile_size},
+        }},
+        {"results", json::array()},
+    };
+
+    std::cout << std::left << std::setw(26) << "function" << std::setw(22) << "input" << std::right
+              << std::setw(4) << "k" << std::setw(12) << "median_ms" << std::setw(14) << "ns/px/iter"
+              << std::setw(10) << "GB/s" << "\n";
+    for (const BenchInput& input : inputs) {
+        for (const float rate : options.rates) {
+            for (const json& r : bench_input(input, rate, params, options)) {
+                std::cout << std::left << std::setw(26) << r["function"].get<std::string>() << std::setw(22)
+                          << r["input"].get<std::string>() << std::right << std::setw(4) << std::lround(1 / rate)
+                          << std::fixed << std::setprecision(2) << std::setw(12)
+                          << r["median_sec"].get<double>() * 1e3 << std::setprecision(3) << std::setw(14)
+                          << (r["ns_per_pixel_iteration"].is_null() ? 0.0 : r["ns_per_pixel_iteration"].get<double>())
+                          << std::setprecision(2) << std::setw(10)
+                          << (r["bandwidth_gbs"].is_null() ? 0.0 : r["bandwidth_gbs"].get<double>()) << std::endl;
+                report["results"].push_back(r);
+            }
+        }
+    }
+
+    std::ofstream out(options.out);
+    if (!out.is_open()) {
+        std::cerr << "Unable to write " << options.out.string() << std::endl;
+        return -1;
+    }
+    out << report.dump(2) << "\n";
+    out.close();
+    std::cout << "results: " << options.out.string() << std::endl;
+
+    if (!options.compare.empty()) {
+        try {
+            if (compare_results(report, options.compare, options.threshold)) {
+                return 1;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+# Общие функции для скриптов bench/*.sh (подключается через source).
+# Ожидает переменные BIN (каталог с main_cw и calculate_metric), K, RATE, ROOT (prj.cw).
+
+run_config() {
+  local NAME=$1
+  shift
+  local OUT="$ROOT/bench_out/$NAME"
+  mkdir -p "$OUT/img" "$OUT/tmp"
+
+  # списки с абсолютными путями, выход и снимки - в каталог конфигурации
+  sed "s|^|$ROOT/|" "$ROOT/img_lst" > "$OUT/img_lst"
+  sed "s|^|$ROOT/|" "$ROOT/json_lst" > "$OUT/json_lst"
+  sed "s|^|$ROOT/|" "$ROOT/gt_lst" > "$OUT/gt_lst"
+  sed "s|^|$ROOT/|" "$ROOT/gt_json_lst" > "$OUT/gt_json_lst"
+  sed "s|.*/|img/|" "$ROOT/output_lst" > "$OUT/output_lst"
+  sed "s|.*/|tmp/|; s|_res\.[A-Za-z]*$|_|" "$ROOT/output_lst" > "$OUT/tmp_lst"
+
+  (cd "$OUT" && "$BIN/main_cw" img_lst json_lst output_lst "$RATE" tmp_lst "$@" > /dev/null)
+  (cd "$OUT" && "$BIN/calculate_metric" output_lst gt_lst gt_json_lst)
+
+  local TIME=$(awk -F, 'NR > 1 { s += $3 } END { printf "%.2f", s }' "$OUT/timings.csv")
+  local QUALITY=$(awk -F, 'NR > 1 { p += $2; s += $3; n++ } END { printf "%.3f,%.4f", p / n, s / n }' "$OUT/metrics.csv")
+  echo "$NAME,$K,$TIME,$QUALITY"
+}
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Сравнение явного incre_filling и неявного (--if-solver=adi) при нескольких --if-iters:
+# суммарное время (timings.csv из main_cw) и средние PSNR/SSIM (metrics.csv из calculate_metric).
+#
+# Запуск из prj.cw:  bench/incre_adi.sh <bin_dir> [k] [steps] [доп. опции main_cw]
+
+set -e
+
+if [ -z "$1" ]; then
+  echo "Usage: bench/incre_adi.sh <bin_dir> [k] [steps] [main_cw options]"
+  exit 1
+fi
+
+BIN=$(realpath "$1")
+K=${2:-5}
+STEPS=${3:-8}
+shift $(( $# < 3 ? $# : 3 ))
+ROOT=$(pwd)
+RATE=$(awk "BEGIN { print 1 / $K }")
+
+source "$(dirname "$0")/common.sh"
+
+echo "config,k,total_sec,mean_psnr,mean_ssim"
+for ITERS in 100 400; do
+  run_config "explicit_$ITERS" --if-iters=$ITERS "$@"
+  run_config "adi_$ITERS" --if-iters=$ITERS --if-solver=adi --if-adi-steps=$STEPS "$@"
+done
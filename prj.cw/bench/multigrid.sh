@@ -0,0 +1,26 @@
+#!/bin/bash
+# Сравнение одноуровневого и пирамидального water_filling:
+# суммарное время (timings.csv из main_cw) и средние PSNR/SSIM (metrics.csv из calculate_metric).
+#
+# Запуск из prj.cw:  bench/multigrid.sh <bin_dir> [k] [levels] [refine_iters]
+# Списки img_lst, json_lst, output_lst, gt_lst, gt_json_lst берутся из prj.cw.
+
+set -e
+
+if [ -z "$1" ]; then
+  echo "Usage: bench/multigrid.sh <bin_dir> [k] [levels] [refine_iters]"
+  exit 1
+fi
+
+BIN=$(realpath "$1")
+K=${2:-5}
+LEVELS=${3:-3}
+REFINE=${4:-200}
+ROOT=$(pwd)
+RATE=$(awk "BEGIN { print 1 / $K }")
+
+source "$(dirname "$0")/common.sh"
+
+echo "config,k,total_sec,mean_psnr,mean_ssim"
+run_config single
+run_config "pyramid_l$LEVELS" --wf-levels="$LEVELS" --wf-refine-iters="$REFINE"
@@ -0,0 +1,24 @@
+#!/bin/bash
+# Сравнение хранения состояния решателей во float и в Q8.8 (uint16):
+# суммарное время (timings.csv из main_cw) и средние PSNR/SSIM (metrics.csv из calculate_metric).
+#
+# Запуск из prj.cw:  bench/precision.sh <bin_dir> [k] [доп. опции main_cw]
+
+set -e
+
+if [ -z "$1" ]; then
+  echo "Usage: bench/precision.sh <bin_dir> [k] [main_cw options]"
+  exit 1
+fi
+
+BIN=$(realpath "$1")
+K=${2:-5}
+shift $(( $# < 2 ? $# : 2 ))
+ROOT=$(pwd)
+RATE=$(awk "BEGIN { print 1 / $K }")
+
+source "$(dirname "$0")/common.sh"
+
+echo "config,k,total_sec,mean_psnr,mean_ssim"
+run_config f32 --precision=f32 "$@"
+run_config q8 --precision=q8 "$@"
@@ -0,0 +1,63 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Очередь между стадиями конвейера: push() ждёт свободного места, pop() - элемента.
+// После close() push() возвращает false, а pop() отдаёт оставшееся и затем std::nullopt.
+template <class T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(const size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+	bool push(T item)
+	{
+		std::unique_lock lock(mutex_);
+		changed_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+		if (closed_)
+		{
+			return false;
+		}
+		items_.push_back(std::move(item));
+		lock.unlock();
+		changed_.notify_all();
+		return true;
+	}
+
+	std::optional<T> pop()
+	{
+		std::unique_lock lock(mutex_);
+		changed_.wait(lock, [this] { return closed_ || !items_.empty(); });
+		if (items_.empty())
+		{
+			return std::nullopt;
+		}
+		T item = std::move(items_.front());
+		items_.pop_front();
+		lock.unlock();
+		changed_.notify_all();
+		return item;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard lock(mutex_);
+			closed_ = true;
+		}
+		changed_.notify_all();
+	}
+
+private:
+	size_t capacity_;
+	std::deque<T> items_;
+	std::mutex mutex_;
+	std::condition_variable changed_;
+	bool closed_ = false;
+};
+
+#endif //BOUNDED_QUEUE_H
@@ -0,0 +1,107 @@
+// Тестовый клиент main_cw --serve: отправляет изображение и печатает ответ сервера.
+#include "local_socket.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <unistd.h>
+
+std::vector<unsigned char> read_file(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("Unable to open " + path.string());
+    }
+    return {std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+}
+
+int main(const int argc, char** argv) {
+    if (argc >= 3 && std::string(argv[2]) == "--shutdown") {
+        try {
+            const int fd = connect_local(argv[1]);
+            Message request;
+            request.header = {{"command", "shutdown"}};
+            send_message(fd, std::move(request));
+            Message response;
+            receive_message(fd, response);
+            std::cout << response.header.dump() << std::endl;
+            close(fd);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+    if (argc < 4) {
+        std::cerr << "Usage: cw_client <socket_path> <image_path> <output_path> [--json=<roi_json>] [--rate=X]"
+                     " [--inline] [--repeat=N] [solver options, e.g. --if-iters=50]\n"
+                     "       cw_client <socket_path> --shutdown"
+                     << std::endl;
+        return -1;
+    }
+
+    // сервер работает в своём каталоге, поэтому пути передаются абсолютными
+    const fs::path image_path = fs::absolute(argv[2]);
+    const fs::path output_path = fs::absolute(argv[3]);
+    Message request;
+    bool send_bytes = false;
+    int repeat = 1;
+    std::vector<std::string> options;
+    for (int a = 4; a < argc; a++) {
+        const std::string arg = argv[a];
+        const size_t eq = arg.find('=');
+        const std::string key = arg.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        if (key == "--json") {
+            request.header["json"] = fs::absolute(value).string();
+        } else if (key == "--rate") {
+            request.header["rate"] = std::stof(value);
+        } else if (key == "--inline") {
+            send_bytes = true;
+        } else if (key == "--repeat") {
+            repeat = std::max(1, std::stoi(value));
+        } else {
+            options.push_back(arg);
+        }
+    }
+    if (!options.empty()) {
+        request.header["options"] = options;
+    }
+
+    try {
+        if (send_bytes) {
+            // изображение и результат идут через сокет, сервер не трогает диск
+            request.payload = read_file(image_path);
+            request.header["format"] = output_path.extension().string();
+        } else {
+            request.header["image"] = image_path.string();
+            request.header["output"] = output_path.string();
+        }
+        const int fd = connect_local(argv[1]);
+        // повторы в одном соединении показывают задержку на тёплом сервере
+        for (int r = 0; r < repeat; r++) {
+            const auto start = std::chrono::steady_clock::now();
+            send_message(fd, request);
+            Message response;
+            if (!receive_message(fd, response)) {
+                throw std::runtime_error("Server closed the connection");
+            }
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "round trip: " << elapsed.count() << " sec, " << response.header.dump() << std::endl;
+            if (!response.header.value("ok", false)) {
+                close(fd);
+                return -1;
+            }
+            if (send_bytes) {
+                std::ofstream out(output_path, std::ios::binary);
+                out.write(reinterpret_cast<const char*>(response.payload.data()),
+                          static_cast<std::streamsize>(response.payload.size()));
+            }
+        }
+        close(fd);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
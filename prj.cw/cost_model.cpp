@@ -0,0 +1,158 @@
+#include "cost_model.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Размер уменьшенной сетки, как у ShadowRemovalEngine::process()
+static cv::Size low_res_size(const cv::Size size, const float rate)
+{
+	return cv::Size(cv::saturate_cast<int>(size.width * static_cast<double>(rate)),
+		cv::saturate_cast<int>(size.height * static_cast<double>(rate)));
+}
+
+CostModel CostModel::calibrate(const WaterFillingParams& params)
+{
+	// плавный градиент с тёмным пятном - похоже на страницу с тенью
+	cv::Mat crop(480, 640, CV_8UC3);
+	for (int y = 0; y < crop.rows; y++)
+	{
+		uchar* row = crop.ptr<uchar>(y);
+		for (int x = 0; x < crop.cols; x++)
+		{
+			const double shadow = std::hypot(x - 220, y - 260) < 120 ? 0.5 : 1.0;
+			const uchar v = cv::saturate_cast<uchar>((180 + 40.0 * x / crop.cols) * shadow + (x * 7 + y * 13) % 9);
+			row[3 * x] = row[3 * x + 1] = row[3 * x + 2] = v;
+		}
+	}
+
+	// одноуровневый решатель с фиксированным числом итераций, остальное - как в params
+	WaterFillingParams p = params;
+	p.wf_iterations = 300;
+	p.if_iterations = 30;
+	p.wf_tolerance = 0;
+	p.if_tolerance = 0;
+	p.wf_levels = 1;
+	p.if_low_res = false;
+	p.if_solver = IfSolver::Explicit;
+	p.warm_start = false;
+	p.tile_size = 0;
+	p.snapshot_sink = nullptr;
+	const float rate = 0.25f;
+
+	ShadowRemovalEngine engine(p);
+	SolverStats stats;
+	// первый прогон выделяет буферы и разогревает пул потоков
+	engine.process(crop, rate, fs::path());
+	engine.process(crop, rate, fs::path(), &stats);
+
+	const double low = low_res_size(crop.size(), rate).area();
+	const double full = crop.size().area();
+	CostModel model;
+	model.wf = stats.wf_time.wall / (low * std::max(stats.wf_iterations, 1));
+	model.incre = stats.if_time.wall / (full * std::max(stats.if_iterations, 1));
+	model.pixel = (stats.downsample_time.wall + stats.upsample_time.wall + stats.merge_time.wall) / full;
+	return model;
+}
+
+bool CostModel::load(const fs::path& path)
+{
+	std::ifstream in(path);
+	if (!in.is_open())
+	{
+		return false;
+	}
+	nlohmann::json j;
+	in >> j;
+	wf = j.at("wf").get<double>();
+	incre = j.at("incre").get<double>();
+	pixel = j.at("pixel").get<double>();
+	return true;
+}
+
+void CostModel::save(const fs::path& path) const
+{
+	std::ofstream out(path);
+	if (!out.is_open())
+	{
+		throw std::runtime_error("Unable to write cost profile: " + path.string());
+	}
+	out << nlohmann::json{{"wf", wf}, {"incre", incre}, {"pixel", pixel}}.dump(2) << "\n";
+}
+
+double CostModel::predict(const cv::Size size, const float rate, const WaterFillingParams& params) const
+{
+	const cv::Size low = low_res_size(size, rate);
+	const double full_pixels = size.area();
+	const double low_pixels = low.area();
+
+	// пирамида water_filling: полный цикл на грубом уровне и уточнение на остальных
+	double wf_work = low_pixels * params.wf_iterations;
+	cv::Size level = low;
+	double level_pixels = low_pixels;
+	double refine_pixels = 0;
+	for (int l = 1; l < params.wf_levels && std::min(level.width, level.height) >= 16; l++)
+	{
+		refine_pixels += level_pixels;
+		level = cv::Size((level.width + 1) / 2, (level.height + 1) / 2);
+		level_pixels = level.area();
+		wf_work = level_pixels * params.wf_iterations + refine_pixels * params.wf_refine_iterations;
+	}
+
+	// на уменьшенной сетке incre_filling делает if_iterations * rate² итераций;
+	// неявный шаг (две прогонки и проекция) - около четырёх явных итераций, от if_iterations не зависит
+	constexpr double adi_step_cost = 4.0;
+	const double if_pixels = params.if_low_res ? low_pixels : full_pixels;
+	const bool adi = params.if_solver == IfSolver::Adi && (params.tile_size == 0 || params.if_low_res);
+	const double if_work = adi
+		? if_pixels * adi_step_cost * std::max(params.if_adi_steps, 1)
+		: params.if_low_res
+		? low_pixels * std::max(1.0, std::round(params.if_iterations * low_pixels / std::max(full_pixels, 1.0)))
+		: full_pixels * params.if_iterations;
+
+	return wf * wf_work + incre * if_work + pixel * full_pixels;
+}
+
+BudgetChoice choose_for_budget(const CostModel& model, const cv::Size size, const double budget,
+	const float max_rate, const WaterFillingParams& params)
+{
+	// water_filling на сетке меньше этой теряет смысл; k больше 16 заметно портит результат
+	constexpr int min_low_res_side = 16;
+	constexpr int max_k = 16;
+
+	BudgetChoice choice;
+	choice.params = params;
+	const int first_k = std::max(1, static_cast<int>(std::lround(1 / max_rate)));
+	double previous = 0;
+	for (int k = first_k; k <= std::max(first_k, max_k); k++)
+	{
+		const float rate = 1.f / k;
+		if (k > first_k && std::min(size.width, size.height) * rate < min_low_res_side)
+		{
+			break;
+		}
+		const double predicted = model.predict(size, rate, params);
+		// время уже почти целиком в incre_filling и однократных проходах, большее k не поможет
+		if (k > first_k && previous - predicted < 0.02 * predicted)
+		{
+			break;
+		}
+		choice.rate = rate;
+		choice.predicted = previous = predicted;
+		if (predicted <= budget)
+		{
+			return choice;
+		}
+	}
+
+	// не укладывается и при самом грубом k: итерации пропорционально остатку бюджета
+	const double fixed = model.pixel * size.area();
+	const double scale = std::clamp((budget - fixed) / std::max(choice.predicted - fixed, 1e-12), 0.0, 1.0);
+	const auto scaled = [scale](const int iterations, const int floor) {
+		return std::min(iterations, std::max(floor, static_cast<int>(iterations * scale)));
+	};
+	choice.params.wf_iterations = scaled(params.wf_iterations, 50);
+	choice.params.wf_refine_iterations = scaled(params.wf_refine_iterations, 20);
+	choice.params.if_iterations = scaled(params.if_iterations, 5);
+	choice.predicted = model.predict(size, choice.rate, choice.params);
+	return choice;
+}
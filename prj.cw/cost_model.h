@@ -0,0 +1,40 @@
+#ifndef COST_MODEL_H
+#define COST_MODEL_H
+
+#include "water_filling.h"
+
+// Модель времени ShadowRemovalEngine::process() на этой машине:
+// wf - секунд на пиксель уменьшенной сетки за итерацию water_filling,
+// incre - секунд на пиксель сетки incre_filling за итерацию,
+// pixel - секунд на пиксель кропа на однократные проходы (уменьшение, увеличение, итоговый BGR).
+// По порогу остановки прогноз - верхняя граница: считается полное число итераций.
+struct CostModel {
+	double wf = 0;
+	double incre = 0;
+	double pixel = 0;
+
+	// Замер на синтетическом кропе с параметрами решателя params (потоки, точность, ядро)
+	static CostModel calibrate(const WaterFillingParams& params);
+
+	// JSON {"wf": .., "incre": .., "pixel": ..}; load() без файла возвращает false
+	bool load(const fs::path& path);
+	void save(const fs::path& path) const;
+
+	// Прогноз в секундах для кропа size при уменьшении rate
+	double predict(cv::Size size, float rate, const WaterFillingParams& params) const;
+};
+
+// Выбор для бюджета: rate и параметры (с уменьшенным числом итераций, если нужно)
+struct BudgetChoice {
+	float rate = 0;
+	WaterFillingParams params;
+	double predicted = 0;
+};
+
+// Наименьшее k >= 1 / max_rate (не больше 16), при котором прогноз укладывается в budget секунд,
+// с итерациями из params. Если не укладывается и при наибольшем полезном k (дальше время почти
+// не падает), итерации уменьшаются пропорционально остатку бюджета (с нижними пределами).
+BudgetChoice choose_for_budget(const CostModel& model, cv::Size size, double budget, float max_rate,
+	const WaterFillingParams& params);
+
+#endif // COST_MODEL_H
@@ -0,0 +1,33 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <opencv2/opencv.hpp>
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Общее для main_cw, calculate_metric и sweep_cw: списки файлов, ROI из JSON разметки,
+// выравнивание кропа по ROI и SSIM.
+
+// Прямоугольный ROI {"x", "y", "width", "height"}
+cv::Rect loadROIFromJson(const std::string& json_path);
+
+// Пути из lst-файла, по одному в строке, относительно каталога lst; пустые строки пропускаются
+std::vector<fs::path> get_list_of_file_paths(const fs::path& path_lst);
+
+// 4 точки ROI из JSON разметки {"points": [{"x": .., "y": ..}, ...]}
+std::vector<cv::Point2f> loadPolygonROIFromJson(const std::string& json_path);
+
+// Перспективное преобразование polygon -> прямой прямоугольник и размер выровненного кропа
+cv::Mat alignByPolygon(const std::vector<cv::Point2f>& polygon, cv::Size& size);
+
+// Выровненный кроп img по polygon
+cv::Mat cropAndAlignByPolygon(const cv::Mat& img, const std::vector<cv::Point2f>& polygon);
+
+// Средний по каналам SSIM (окно Гаусса 11x11, σ = 1.5)
+double getMSSIM(const cv::Mat& i1, const cv::Mat& i2);
+
+#endif // DATASET_H
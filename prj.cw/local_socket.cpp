@@ -0,0 +1,167 @@
+#include "local_socket.h"
+
+#ifndef _WIN32
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// заголовок больше этого - ошибка протокола, а не повод читать бесконечно
+static constexpr size_t max_header_bytes = 1 << 20;
+// размер payload берётся из заголовка клиента: без предела один заголовок мог бы заставить
+// выделить гигабайты; 256 МБ хватает несжатому кадру 8K и результату того же размера
+static constexpr size_t max_payload_bytes = size_t(256) << 20;
+
+static std::runtime_error socket_error(const std::string& what)
+{
+	return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+static sockaddr_un local_address(const fs::path& path)
+{
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	const std::string name = path.string();
+	if (name.size() >= sizeof(address.sun_path))
+	{
+		throw std::runtime_error("Socket path is too long: " + name);
+	}
+	std::memcpy(address.sun_path, name.c_str(), name.size() + 1);
+	return address;
+}
+
+int listen_local(const fs::path& path, const int backlog)
+{
+	const sockaddr_un address = local_address(path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		throw socket_error("socket");
+	}
+	unlink(address.sun_path);
+	if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0
+		|| listen(fd, backlog) < 0)
+	{
+		const std::runtime_error error = socket_error("Unable to listen on " + path.string());
+		close(fd);
+		throw error;
+	}
+	return fd;
+}
+
+int connect_local(const fs::path& path)
+{
+	const sockaddr_un address = local_address(path);
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		throw socket_error("socket");
+	}
+	if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+	{
+		const std::runtime_error error = socket_error("Unable to connect to " + path.string());
+		close(fd);
+		throw error;
+	}
+	return fd;
+}
+
+// size байт в data; false - EOF до первого байта
+static bool read_exact(const int fd, unsigned char* data, const size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		const ssize_t n = read(fd, data + done, size - done);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0)
+		{
+			throw socket_error("read");
+		}
+		if (n == 0)
+		{
+			if (done == 0)
+			{
+				return false;
+			}
+			throw std::runtime_error("Connection closed in the middle of a message");
+		}
+		done += static_cast<size_t>(n);
+	}
+	return true;
+}
+
+static void write_all(const int fd, const unsigned char* data, const size_t size)
+{
+	size_t done = 0;
+	while (done < size)
+	{
+		const ssize_t n = write(fd, data + done, size - done);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0)
+		{
+			throw socket_error("write");
+		}
+		done += static_cast<size_t>(n);
+	}
+}
+
+bool receive_message(const int fd, Message& message)
+{
+	// заголовок короткий, поэтому читается по байту: payload не должен попасть в буфер строки
+	std::string header;
+	unsigned char c;
+	while (true)
+	{
+		if (!read_exact(fd, &c, 1))
+		{
+			if (header.empty())
+			{
+				return false;
+			}
+			throw std::runtime_error("Connection closed in the middle of a message");
+		}
+		if (c == '\n')
+		{
+			break;
+		}
+		if (header.size() >= max_header_bytes)
+		{
+			throw std::runtime_error("Message header is too long");
+		}
+		header.push_back(static_cast<char>(c));
+	}
+
+	message.header = nlohmann::json::parse(header);
+	const nlohmann::json& size = message.header.contains("size") ? message.header["size"] : nlohmann::json(size_t(0));
+	if (!size.is_number_unsigned() || size.get<uint64_t>() > max_payload_bytes)
+	{
+		throw std::runtime_error("Invalid message size " + size.dump() + " (limit "
+			+ std::to_string(max_payload_bytes) + " bytes)");
+	}
+	message.payload.resize(size.get<size_t>());
+	if (!message.payload.empty() && !read_exact(fd, message.payload.data(), message.payload.size()))
+	{
+		throw std::runtime_error("Connection closed in the middle of a message");
+	}
+	return true;
+}
+
+void send_message(const int fd, Message message)
+{
+	message.header["size"] = message.payload.size();
+	const std::string header = message.header.dump() + "\n";
+	write_all(fd, reinterpret_cast<const unsigned char*>(header.data()), header.size());
+	write_all(fd, message.payload.data(), message.payload.size());
+}
+
+#endif // _WIN32
@@ -0,0 +1,36 @@
+#ifndef LOCAL_SOCKET_H
+#define LOCAL_SOCKET_H
+
+// Сообщения поверх Unix domain socket для main_cw --serve и cw_client.
+// Сообщение - заголовок JSON в одну строку с '\n' и сразу за ним payload из header["size"] байт
+// (нет поля - payload пуст, больше 256 МБ - ошибка протокола). Только POSIX: на Windows не собирается.
+#ifndef _WIN32
+
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+struct Message {
+	nlohmann::json header;
+	std::vector<unsigned char> payload;
+};
+
+// Сокет, слушающий path; существующий файл сокета удаляется. Ошибки - std::runtime_error.
+int listen_local(const fs::path& path, int backlog = 16);
+
+// Соединение с сервером на path
+int connect_local(const fs::path& path);
+
+// Сообщение из fd; false - соединение закрыто до начала сообщения.
+// Обрыв посреди сообщения или неверный заголовок - std::runtime_error.
+bool receive_message(int fd, Message& message);
+
+// Отправляет сообщение; header["size"] выставляется по payload
+void send_message(int fd, Message message);
+
+#endif // _WIN32
+
+#endif // LOCAL_SOCKET_H
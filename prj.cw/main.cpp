@@ -1,151 +1,787 @@
 #include "water_filling.h"
+#include "snapshot_sink.h"
+#include "bounded_queue.h"
+#include "manifest.h"
+#include "dataset.h"
+#include "local_socket.h"
+#include "result_cache.h"
+#include "cost_model.h"
+#include "solver_options.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <semaphore>
+#include <sstream>
+#include <thread>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 using json = nlohmann::json;
 
-// Загружаем JSON и извлекаем ROI
-cv::Rect loadROIFromJson(const std::string& json_path) {
-    std::ifstream in(json_path);
-    json j;
-    in >> j;
+// Кроп и уменьшенный Y для ShadowRemovalEngine::process(): Y берётся прямо из img по тому же
+// преобразованию, полноразмерный кроп нужен только итоговой коррекции цвета
+cv::Mat cropAndAlignByPolygon(const cv::Mat& img, const std::vector<cv::Point2f>& polygon, const float rate,
+                              cv::Mat& luma_low) {
+    cv::Size size;
+    const cv::Mat M = alignByPolygon(polygon, size);
+    cv::Mat aligned;
+    cv::warpPerspective(img, aligned, M, size);
+    luma_low = warp_low_res_luma(img, M, size, rate);
+    return aligned;
+}
 
-    int x = j["x"];
-    int y = j["y"];
-    int w = j["width"];
-    int h = j["height"];
+// Параметры задания из манифеста: общие params с его опциями поверх
+WaterFillingParams job_params(const std::vector<std::string>& options, const WaterFillingParams& params) {
+    WaterFillingParams out = params;
+    for (const std::string& option : options) {
+        const size_t eq = option.find('=');
+        const std::string key = option.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : option.substr(eq + 1);
+        if (!parse_solver_option(key, value, out)) {
+            throw std::runtime_error("Option is not allowed per job: " + option);
+        }
+    }
+    return out;
+}
 
-    return {x, y, w, h};
+// Изображение на пути через конвейер
+struct Job {
+    size_t index = 0;
+    cv::Mat img;                      // decode -> warp
+    std::vector<cv::Point2f> roi_pts;
+    cv::Mat img_crop;                 // warp -> shadow removal
+    cv::Mat luma_low;                 // warp -> shadow removal: уменьшенный Y, прямо из img
+    WaterFillingParams params;        // параметры решателя (в режиме --budget - с выбранными итерациями)
+    cv::Mat result;                   // shadow removal -> encode
+    std::vector<uchar> encoded;       // encode -> запись
+    SolverStats stats;
+    double duration = 0;
+    // время стадий вне решателя (downsample - выборка уменьшенного Y на стадии выравнивания);
+    // этапы решателя - в stats
+    StageTime decode_time, roi_time, warp_time, downsample_time, encode_time;
+    std::string error;                // непустая - изображение не обработано, дальше не идёт
+    std::string cache_key;            // непустой - результат сохранить в кеш после кодирования
+    bool cache_hit = false;           // encoded взят из кеша, решатель и кодирование пропущены
+    float rate = 0;                   // 1/k, с которым обработано изображение
+    double predicted = 0;             // прогноз времени решателя в режиме --budget, сек
+};
+
+struct PipelineOptions {
+    int decode_workers = 1;
+    int warp_workers = 1;
+    int solver_workers = 1;
+    int encode_workers = 1;
+    size_t queue_size = 2;
+    // обрабатывается каждое shard_count-е задание, начиная с shard_index
+    int shard_index = 0;
+    int shard_count = 1;
+    // кеш результатов (пусто - выключен) и его размер
+    fs::path cache_dir;
+    uintmax_t cache_bytes = uintmax_t(1) << 30;
+    // бюджет времени решателя на изображение, сек (0 - k из командной строки) и файл модели
+    double budget = 0;
+    fs::path cost_profile;
+};
+
+// workers потоков стадии берут задания из in и кладут в out; последний из них закрывает out.
+// Задания с ошибкой проходят стадию без обработки, чтобы запись остановилась на них по порядку.
+template <class Body>
+void start_stage(std::vector<std::thread>& threads, const int workers, BoundedQueue<Job>& in,
+                 BoundedQueue<Job>& out, Body body) {
+    auto alive = std::make_shared<std::atomic<int>>(workers);
+    for (int worker = 0; worker < workers; worker++) {
+        threads.emplace_back([&in, &out, body, alive, worker]() mutable {
+            while (std::optional<Job> job = in.pop()) {
+                if (job->error.empty()) {
+                    try {
+                        body(*job, worker);
+                    } catch (const std::exception& e) {
+                        job->error = e.what();
+                    }
+                }
+                if (!out.push(std::move(*job))) {
+                    break;
+                }
+            }
+            if (--*alive == 0) {
+                out.close();
+            }
+        });
+    }
 }
 
-std::vector<fs::path> get_list_of_file_paths(const fs::path& path_lst) {
-    std::vector<fs::path> file_paths;
-    std::ifstream infile(path_lst);
-    std::string line;
-    fs::path lst_directory = path_lst.parent_path();
+// Конвейер decode+ROI -> warp -> удаление тени -> encode -> запись по порядку.
+// У каждой стадии свои потоки, решатель не ждёт диска и кодеков. Файлы, timings.csv и вывод
+// пишутся строго в порядке списка, поэтому совпадают с последовательным запуском.
+int run_pipeline(const std::vector<ManifestEntry>& entries, const float rate, const WaterFillingParams& params,
+                 const PipelineOptions& options, std::ofstream& timings_file) {
+    const size_t n = entries.size();
+
+    // параметры решателя заданий: общие и с опциями из манифеста, разбираются до запуска
+    std::map<std::vector<std::string>, WaterFillingParams> variants{{{}, params}};
+    for (const ManifestEntry& entry : entries) {
+        if (!variants.count(entry.options)) {
+            variants.emplace(entry.options, job_params(entry.options, params));
+        }
+    }
 
-    if (!infile.is_open()) {
-        throw std::runtime_error("Unable to open lst file: " + path_lst.string());
+    // С тёплым стартом изображение стартует с w_ предыдущего в том же движке, а движки у
+    // каждого потока решателя свои: при нескольких потоках результат зависел бы от того, какой
+    // поток взял изображение. Поэтому тёплый старт - только с одним потоком решателя.
+    int solver_workers = options.solver_workers;
+    const bool warm_start = std::any_of(variants.begin(), variants.end(),
+                                        [](const auto& variant) { return variant.second.warm_start; });
+    if (warm_start && solver_workers > 1) {
+        std::cerr << "--warm-start: using 1 solver worker instead of " << solver_workers
+                  << " so that the result does not depend on scheduling" << std::endl;
+        solver_workers = 1;
     }
 
-    while (std::getline(infile, line)) {
-        if (!line.empty()) {
-            fs::path file_path = lst_directory / line;
-            file_paths.push_back(file_path);
+    // Режим бюджета: модель времени из профиля или замер перед запуском
+    CostModel cost_model;
+    if (options.budget > 0) {
+        if (options.cost_profile.empty() || !cost_model.load(options.cost_profile)) {
+            cost_model = CostModel::calibrate(params);
+            if (!options.cost_profile.empty()) {
+                cost_model.save(options.cost_profile);
+            }
         }
+        std::cout << "cost model: wf " << cost_model.wf << ", incre " << cost_model.incre << ", pixel "
+                  << cost_model.pixel << " sec" << std::endl;
     }
 
-    return file_paths;
-}
+    // Кеш результатов: ключ - хеш кропа, ROI и параметров. С тёплым стартом результат зависит
+    // от предыдущего изображения, такие задания не кешируются.
+    // Кеш и модель времени создаются до запуска потоков: их исключения (нет каталога, ошибка
+    // замера или записи профиля) иначе оставили бы потоки без join и вызвали std::terminate.
+    std::unique_ptr<ResultCache> cache;
+    if (!options.cache_dir.empty()) {
+        cache = std::make_unique<ResultCache>(options.cache_dir, options.cache_bytes);
+    }
 
+    BoundedQueue<Job> decoded(options.queue_size), warped(options.queue_size),
+        solved(options.queue_size), encoded(options.queue_size);
+
+    // число изображений внутри конвейера ограничено, иначе буфер переупорядочивания
+    // перед записью мог бы расти, пока одно изображение задерживается в решателе
+    const std::ptrdiff_t max_in_flight = static_cast<std::ptrdiff_t>(4 * options.queue_size)
+        + options.decode_workers + options.warp_workers + solver_workers + options.encode_workers;
+    std::counting_semaphore<> slots(max_in_flight);
+    std::atomic<size_t> next{0};
+    std::atomic<bool> abort{false};
+
+    std::vector<std::thread> threads;
+
+    // Загружаем изображение и json
+    auto decoders_alive = std::make_shared<std::atomic<int>>(options.decode_workers);
+    for (int worker = 0; worker < options.decode_workers; worker++) {
+        threads.emplace_back([&, decoders_alive] {
+            while (true) {
+                slots.acquire();
+                const size_t i = next++;
+                if (abort || i >= n) {
+                    slots.release();
+                    break;
+                }
+                Job job;
+                job.index = i;
+                try {
+                    StageTimer timer;
+                    job.img = cv::imread(entries[i].image, cv::IMREAD_COLOR);
+                    job.decode_time = timer.lap();
+                    if (job.img.empty()) {
+                        std::stringstream message;
+                        message << "Image not found: " << entries[i].image;
+                        job.error = message.str();
+                    } else {
+                        // 4 точки из манифеста или из JSON
+                        job.roi_pts = entries[i].points.empty() ? loadPolygonROIFromJson(entries[i].json)
+                                                                : entries[i].points;
+                        job.roi_time = timer.lap();
+                    }
+                } catch (const std::exception& e) {
+                    job.error = e.what();
+                }
+                if (!decoded.push(std::move(job))) {
+                    break;
+                }
+            }
+            if (--*decoders_alive == 0) {
+                decoded.close();
+            }
+        });
+    }
 
-// Загружаем JSON и извлекаем 4 точки ROI
-std::vector<cv::Point2f> loadPolygonROIFromJson(const std::string& json_path) {
-    std::ifstream in(json_path);
-    if (!in.is_open()) {
-        throw std::runtime_error("Не удалось открыть JSON: " + json_path);
+    // Получаем выровненный кроп. k и параметры решателя зависят только от размера кропа,
+    // поэтому выбираются здесь, и уменьшенный Y для решателя берётся прямо из исходного изображения.
+    start_stage(threads, options.warp_workers, decoded, warped,
+                [&variants, &entries, &cost_model, &options, rate](Job& job, int) {
+        StageTimer timer;
+        const ManifestEntry& entry = entries[job.index];
+        cv::Size size;
+        const cv::Mat M = alignByPolygon(job.roi_pts, size);
+        job.params = variants.at(entry.options);
+        job.rate = entry.rate > 0 ? entry.rate : rate;
+        if (options.budget > 0 && entry.rate <= 0) {
+            // k и итерации по размеру кропа; 1/k из командной строки - самое мелкое допустимое
+            const BudgetChoice choice = choose_for_budget(cost_model, size, options.budget, rate, job.params);
+            job.rate = choice.rate;
+            job.predicted = choice.predicted;
+            job.params = choice.params;
+        }
+        cv::warpPerspective(job.img, job.img_crop, M, size);
+        job.warp_time = timer.lap();
+        // уменьшенный Y - столбец downsample: движок по готовому Y его не уменьшает
+        job.luma_low = warp_low_res_luma(job.img, M, size, job.rate);
+        job.downsample_time = timer.lap();
+        job.img.release();
+    });
+
+    // Удаляем тень; у каждого потока свои движки (по одному на набор опций) со своими буферами
+    using Engines = std::map<std::vector<std::string>, std::unique_ptr<ShadowRemovalEngine>>;
+    std::vector<Engines> engines(solver_workers);
+    start_stage(threads, solver_workers, warped, solved,
+                [&engines, &entries, &cache, &options](Job& job, const int worker) {
+        StageTimer timer;
+        const ManifestEntry& entry = entries[job.index];
+        if (cache && !job.params.warm_start) {
+            const std::string key = result_cache_key(job.img_crop, job.luma_low, job.roi_pts, job.rate, job.params,
+                                                     entry.output.extension().string());
+            if (std::optional<std::vector<uchar>> stored = cache->get(key)) {
+                job.encoded = std::move(*stored);
+                job.cache_hit = true;
+                job.duration = timer.lap().wall;
+                job.img_crop.release();
+                job.luma_low.release();
+                return;
+            }
+            job.cache_key = key;
+        }
+        std::unique_ptr<ShadowRemovalEngine>& engine = engines[worker][entry.options];
+        if (!engine) {
+            engine = std::make_unique<ShadowRemovalEngine>(job.params);
+        } else if (options.budget > 0) {
+            engine->set_params(job.params);
+        }
+        // результат указывает в буфер движка, который переиспользуется следующим изображением
+        job.result = engine->process(job.img_crop, job.luma_low, entry.tmp, &job.stats).clone();
+        job.duration = timer.lap().wall;
+        job.img_crop.release();
+        job.luma_low.release();
+    });
+
+    start_stage(threads, options.encode_workers, solved, encoded, [&entries, &cache](Job& job, int) {
+        if (job.cache_hit) {
+            return;
+        }
+        StageTimer timer;
+        cv::imencode(entries[job.index].output.extension().string(), job.result, job.encoded);
+        job.encode_time = timer.lap();
+        job.result.release();
+        if (!job.cache_key.empty()) {
+            cache->put(job.cache_key, job.encoded);
+        }
+    });
+
+    // Запись по порядку списка; на первом необработанном изображении конвейер останавливается
+    int status = 0;
+    std::map<size_t, Job> pending;
+    size_t written = 0;
+    while (written < n && status == 0) {
+        std::optional<Job> job = encoded.pop();
+        if (!job) {
+            break;
+        }
+        pending.emplace(job->index, std::move(*job));
+        for (auto it = pending.find(written); it != pending.end(); it = pending.find(written)) {
+            Job& done = it->second;
+            if (!done.error.empty()) {
+                std::cerr << done.error << std::endl;
+                status = -1;
+                break;
+            }
+            std::cout << "time: " << done.duration << " sec, bytes/iter: wf " << done.stats.wf_bytes_per_iteration
+                      << ", if " << done.stats.if_bytes_per_iteration << std::endl;
+            const ManifestEntry& entry = entries[done.index];
+            timings_file << entry.image.filename() << ","
+                     << std::lround(1 / done.rate) << ","
+                     << done.duration << ","
+                     << done.stats.wf_iterations << ","
+                     << done.stats.wf_coarse_iterations << ","
+                     << done.stats.if_iterations << ","
+                     << done.stats.wf_bytes_per_iteration << ","
+                     << done.stats.if_bytes_per_iteration;
+            StageTime total;
+            for (const StageTime& stage : {done.decode_time, done.roi_time, done.warp_time, done.downsample_time,
+                                           done.stats.wf_time, done.stats.if_time, done.stats.upsample_time,
+                                           done.stats.merge_time, done.encode_time}) {
+                timings_file << "," << stage.wall << "," << stage.cpu;
+                total.wall += stage.wall;
+                total.cpu += stage.cpu;
+            }
+            timings_file << "," << total.wall << "," << total.cpu << "," << done.cache_hit << "," << done.predicted
+                         << "\n";
+            // Сохраняем
+            std::ofstream out(entry.output, std::ios::binary);
+            out.write(reinterpret_cast<const char*>(done.encoded.data()), static_cast<std::streamsize>(done.encoded.size()));
+            pending.erase(it);
+            written++;
+            slots.release();
+        }
     }
 
-    json j;
-    in >> j;
+    if (status != 0) {
+        // остановить загрузку и разбудить все стадии
+        abort = true;
+        slots.release(options.decode_workers);
+        for (BoundedQueue<Job>* queue : {&decoded, &warped, &solved, &encoded}) {
+            queue->close();
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (cache) {
+        const size_t lookups = cache->hits() + cache->misses();
+        std::cout << "cache: " << cache->hits() << " hits, " << cache->misses() << " misses, hit rate "
+                  << (lookups > 0 ? 100.0 * cache->hits() / lookups : 0) << "%" << std::endl;
+    }
+    return status;
+}
 
-    std::vector<cv::Point2f> polygon;
-    for (const auto& pt : j["points"]) {
-        float x = pt["x"];
-        float y = pt["y"];
-        polygon.emplace_back(x, y);
+// Видео или последовательность кадров (всё, что открывает cv::VideoCapture, например frames/%04d.png).
+// Кадры одной страницы идут через один движок с тёплым стартом от решения прошлого кадра.
+// json_path - ROI для всех кадров ("-" - кадр целиком); output - шаблон имён кадров с %d
+// или видеофайл (MJPG). Задержка каждого кадра пишется в video_timings.csv.
+int run_video(const std::string& input, const std::string& json_path, const std::string& output, const float rate,
+              const WaterFillingParams& params) {
+    cv::VideoCapture capture(input);
+    if (!capture.isOpened()) {
+        std::cerr << "Unable to open video: " << input << std::endl;
+        return -1;
+    }
+    std::vector<cv::Point2f> roi_pts;
+    if (json_path != "-") {
+        roi_pts = loadPolygonROIFromJson(json_path);
     }
 
-    if (polygon.size() != 4) {
-        throw std::runtime_error("Ожидалось 4 точки в JSON: " + json_path);
+    std::ofstream timings_file("video_timings.csv");
+    if (!timings_file.is_open()) {
+        std::cerr << "Failed to open timings file for writing." << std::endl;
+        return -1;
+    }
+    timings_file << "frame,latency_sec,read_sec,warp_sec,solver_sec,write_sec,wf_iterations,if_iterations\n";
+
+    ShadowRemovalEngine engine(params);
+    const bool to_frames = output.find('%') != std::string::npos;
+    cv::VideoWriter writer;
+
+    StageTimer total;
+    cv::Mat frame;
+    int frames = 0;
+    while (true) {
+        StageTimer timer;
+        if (!capture.read(frame) || frame.empty()) {
+            break;
+        }
+        const StageTime read_time = timer.lap();
+
+        cv::Mat luma_low;
+        const cv::Mat img_crop = roi_pts.empty() ? frame : cropAndAlignByPolygon(frame, roi_pts, rate, luma_low);
+        const StageTime warp_time = timer.lap();
+
+        SolverStats stats;
+        const cv::Mat result = luma_low.empty() ? engine.process(img_crop, rate, fs::path(), &stats)
+                                                : engine.process(img_crop, luma_low, fs::path(), &stats);
+        const StageTime solver_time = timer.lap();
+
+        if (to_frames) {
+            cv::imwrite(cv::format(output.c_str(), frames), result);
+        } else {
+            if (!writer.isOpened()) {
+                const double fps = capture.get(cv::CAP_PROP_FPS);
+                writer.open(output, cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), fps > 0 ? fps : 25, result.size());
+                if (!writer.isOpened()) {
+                    std::cerr << "Unable to open video for writing: " << output << std::endl;
+                    return -1;
+                }
+            }
+            writer.write(result);
+        }
+        const StageTime write_time = timer.lap();
+
+        const double latency = read_time.wall + warp_time.wall + solver_time.wall + write_time.wall;
+        std::cout << "frame " << frames << ": " << latency << " sec, iterations: wf " << stats.wf_iterations
+                  << ", if " << stats.if_iterations << std::endl;
+        timings_file << frames << ","
+                     << latency << ","
+                     << read_time.wall << ","
+                     << warp_time.wall << ","
+                     << solver_time.wall << ","
+                     << write_time.wall << ","
+                     << stats.wf_iterations << ","
+                     << stats.if_iterations << "\n";
+        frames++;
     }
 
-    return polygon;
+    const double elapsed = total.lap().wall;
+    std::cout << "frames: " << frames << ", " << elapsed << " sec, "
+              << (elapsed > 0 ? frames / elapsed : 0) << " frames/sec" << std::endl;
+    return 0;
 }
 
-cv::Mat cropAndAlignByPolygon(const cv::Mat& img, const std::vector<cv::Point2f>& polygon) {
-    if (polygon.size() != 4) {
-        throw std::invalid_argument("polygon должен содержать ровно 4 точки");
+#ifndef _WIN32
+// Движки решателя по наборам опций задания; живут, пока жив поток, поэтому буферы тёплые
+using EngineCache = std::map<std::vector<std::string>, std::unique_ptr<ShadowRemovalEngine>>;
+
+// Один запрос --serve. Заголовок - объект в формате строки манифеста: "image" (или байты
+// изображения в payload), "points" или "json" (нет - изображение целиком), "rate", "options", "tmp".
+// С "output" результат пишется в файл, иначе возвращается в payload в формате "format" (".png").
+Message serve_request(const Message& request, const float rate, const WaterFillingParams& params,
+                      EngineCache& engines) {
+    const ManifestEntry entry = entry_from_json(request.header, fs::path());
+    StageTimer timer;
+    const cv::Mat img = request.payload.empty() ? cv::imread(entry.image.string(), cv::IMREAD_COLOR)
+                                                : cv::imdecode(request.payload, cv::IMREAD_COLOR);
+    if (img.empty()) {
+        throw std::runtime_error("Unable to read image " + entry.image.string());
     }
+    const StageTime decode_time = timer.lap();
 
-    // Вычисляем ширину и высоту выровненного изображения
-    const float width_bottom = cv::norm(polygon[1] - polygon[0]);
-    const float width_top    = cv::norm(polygon[2] - polygon[3]);
-    float width = std::max(width_bottom, width_top);
-
-    const float height_left  = cv::norm(polygon[3] - polygon[0]);
-    const float height_right = cv::norm(polygon[2] - polygon[1]);
-    float height = std::max(height_left, height_right);
+    std::vector<cv::Point2f> roi_pts = entry.points;
+    if (roi_pts.empty() && !entry.json.empty()) {
+        roi_pts = loadPolygonROIFromJson(entry.json.string());
+    }
+    const float job_rate = entry.rate > 0 ? entry.rate : rate;
+    cv::Mat luma_low;
+    const cv::Mat img_crop = roi_pts.empty() ? img : cropAndAlignByPolygon(img, roi_pts, job_rate, luma_low);
+    const StageTime warp_time = timer.lap();
+
+    std::unique_ptr<ShadowRemovalEngine>& engine = engines[entry.options];
+    if (!engine) {
+        engine = std::make_unique<ShadowRemovalEngine>(job_params(entry.options, params));
+    }
+    SolverStats stats;
+    const cv::Mat result = luma_low.empty() ? engine->process(img_crop, job_rate, entry.tmp, &stats)
+                                            : engine->process(img_crop, luma_low, entry.tmp, &stats);
+    const StageTime solver_time = timer.lap();
+
+    Message response;
+    if (!entry.output.empty()) {
+        if (!cv::imwrite(entry.output.string(), result)) {
+            throw std::runtime_error("Unable to write " + entry.output.string());
+        }
+    } else {
+        cv::imencode(request.header.value("format", std::string(".png")), result, response.payload);
+    }
+    const StageTime encode_time = timer.lap();
+
+    response.header = {{"ok", true},
+                       {"width", result.cols},
+                       {"height", result.rows},
+                       {"decode_sec", decode_time.wall},
+                       {"warp_sec", warp_time.wall},
+                       {"solver_sec", solver_time.wall},
+                       {"encode_sec", encode_time.wall},
+                       {"wf_iterations", stats.wf_iterations},
+                       {"if_iterations", stats.if_iterations}};
+    return response;
+}
 
-    // Целевые точки: прямой прямоугольник
-    const std::vector<cv::Point2f> dst_pts = {
-        {0.f, height},       // левый нижний
-        {width, height},     // правый нижний
-        {width, 0.f},        // правый верхний
-        {0.f, 0.f}           // левый верхний
-    };
+// Сервер на Unix domain socket: процесс, пул потоков OpenCV и буферы решателя живут между
+// запросами. Соединения обслуживают solver_workers потоков, в одном соединении может быть
+// сколько угодно запросов подряд. {"command": "shutdown"} останавливает сервер.
+int run_server(const fs::path& socket_path, const float rate, const WaterFillingParams& params,
+               const PipelineOptions& options) {
+    // клиент может уйти, не дождавшись ответа: ошибка записи вместо завершения процесса
+    std::signal(SIGPIPE, SIG_IGN);
+    int listener;
+    try {
+        listener = listen_local(socket_path);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    std::cout << "listening on " << socket_path.string() << std::endl;
+
+    BoundedQueue<int> connections(options.queue_size);
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> workers;
+    for (int worker = 0; worker < options.solver_workers; worker++) {
+        workers.emplace_back([&] {
+            EngineCache engines;
+            while (std::optional<int> fd = connections.pop()) {
+                try {
+                    Message request;
+                    while (receive_message(*fd, request)) {
+                        Message response;
+                        if (request.header.value("command", std::string()) == "shutdown") {
+                            stop = true;
+                            response.header = {{"ok", true}};
+                            send_message(*fd, std::move(response));
+                            // разбудить accept() пустым соединением
+                            close(connect_local(socket_path));
+                            break;
+                        }
+                        try {
+                            response = serve_request(request, rate, params, engines);
+                        } catch (const std::exception& e) {
+                            response.header = {{"ok", false}, {"error", e.what()}};
+                        }
+                        send_message(*fd, std::move(response));
+                    }
+                } catch (const std::exception& e) {
+                    // оборванное соединение или не тот протокол: закрыть и обслуживать дальше
+                    std::cerr << "connection: " << e.what() << std::endl;
+                }
+                close(*fd);
+            }
+        });
+    }
 
-    // Матрица трансформации и применение
-    const cv::Mat M = cv::getPerspectiveTransform(polygon, dst_pts);
-    cv::Mat aligned;
-    cv::warpPerspective(img, aligned, M, cv::Size(static_cast<int>(width), static_cast<int>(height)));
+    while (!stop) {
+        const int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "accept: " << std::strerror(errno) << std::endl;
+            break;
+        }
+        if (stop || !connections.push(fd)) {
+            close(fd);
+        }
+    }
 
-    return aligned;
+    connections.close();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    close(listener);
+    unlink(socket_path.c_str());
+    return 0;
+}
+#endif
+
+void print_usage() {
+    std::cerr << "Usage: main_cw <image_path_lst> <json_path_lst> <output_path_lst> <input_rate(1/k)> <tmp_path>"
+                 " [--threads=N] [--neta=X] [--brightness=X] [--wf-iters=N] [--if-iters=N] [--wf-tol=X] [--if-tol=X]"
+                 " [--wf-levels=N] [--wf-refine-iters=N] [--if-low-res] [--if-solver=explicit|adi] [--if-adi-steps=N]"
+                 " [--time-block=N] [--cache-kb=N] [--tile=N]"
+                 " [--precision=f32|q8] [--snapshots=none|jpg|raw] [--wf-snapshots=T,...] [--if-snapshots=T,...]"
+                 " [--decode-workers=N] [--warp-workers=N] [--solver-workers=N] [--encode-workers=N] [--queue-size=N]"
+                 " [--shard=I/N] [--cache=DIR] [--cache-mb=N]"
+                 " [--budget=SEC] [--cost-profile=FILE]\n"
+                 "       main_cw --manifest <manifest.jsonl> <input_rate(1/k)> [options]\n"
+                 "       main_cw --make-manifest <image_path_lst> <json_path_lst> <output_path_lst> <tmp_path>"
+                 " <manifest.jsonl> [<gt_path_lst> <gt_json_path_lst>]\n"
+                 "       main_cw --serve <socket_path> <input_rate(1/k)> [options]\n"
+                 "       main_cw --video <video_or_frames> <json_path|-> <output_video_or_pattern> <input_rate(1/k)>"
+                 " [--warm-start=0|1] [--wf-warm-iters=N] [--if-warm-iters=N] [options]"
+                 << std::endl;
 }
 
+// Позиционный <input_rate(1/k)>: положительное число целиком, иначе false с сообщением
+bool parse_rate(const std::string& text, float& rate) {
+    try {
+        size_t used = 0;
+        rate = std::stof(text, &used);
+        if (used == text.size() && rate > 0) {
+            return true;
+        }
+    } catch (const std::exception&) {
+    }
+    std::cerr << "Invalid input_rate(1/k): " << text << std::endl;
+    return false;
+}
 
+// Необязательные параметры --key=value после позиционных (начиная с argv[first])
+bool parse_options(const int argc, char** argv, const int first, WaterFillingParams& params, PipelineOptions& pipeline,
+                   std::unique_ptr<SnapshotSink>& snapshot_sink) {
+    for (int a = first; a < argc; a++) {
+        const std::string arg = argv[a];
+        const size_t eq = arg.find('=');
+        const std::string key = arg.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+        // числа разбираются через std::stoi/std::stod: нечисловое значение - ошибка опции, а не terminate
+        try {
+            if (parse_solver_option(key, value, params)) {
+                continue;
+            }
+            if (key == "--decode-workers") {
+                pipeline.decode_workers = std::max(1, std::stoi(value));
+            } else if (key == "--warp-workers") {
+                pipeline.warp_workers = std::max(1, std::stoi(value));
+            } else if (key == "--solver-workers") {
+                pipeline.solver_workers = std::max(1, std::stoi(value));
+            } else if (key == "--encode-workers") {
+                pipeline.encode_workers = std::max(1, std::stoi(value));
+            } else if (key == "--queue-size") {
+                pipeline.queue_size = std::max(1, std::stoi(value));
+            } else if (key == "--cache") {
+                pipeline.cache_dir = value;
+            } else if (key == "--cache-mb") {
+                pipeline.cache_bytes = static_cast<uintmax_t>(std::stoull(value)) << 20;
+            } else if (key == "--budget") {
+                pipeline.budget = std::stod(value);
+            } else if (key == "--cost-profile") {
+                pipeline.cost_profile = value;
+            } else if (key == "--shard") {
+                // I/N
+                const size_t slash = value.find('/');
+                pipeline.shard_count = slash == std::string::npos ? 0 : std::stoi(value.substr(slash + 1));
+                pipeline.shard_index = std::stoi(value.substr(0, slash));
+                if (pipeline.shard_count < 1 || pipeline.shard_index < 0 || pipeline.shard_index >= pipeline.shard_count) {
+                    std::cerr << "Invalid shard: " << value << std::endl;
+                    return false;
+                }
+            } else if (key == "--snapshots") {
+                if (value == "jpg") {
+                    snapshot_sink = std::make_unique<AsyncImageSink>();
+                } else if (value == "raw") {
+                    snapshot_sink = std::make_unique<RawDumpSink>();
+                } else if (value == "none") {
+                    snapshot_sink.reset();
+                } else {
+                    std::cerr << "Unknown snapshot sink: " << value << std::endl;
+                    return false;
+                }
+            } else {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                return false;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid option " << arg << ": " << e.what() << std::endl;
+            return false;
+        }
+    }
+    params.snapshot_sink = snapshot_sink.get();
+    return true;
+}
 
 int main(const int argc, char** argv) {
-    if (argc < 6) {
-        std::cerr << "Usage: main_cw <image_path_lst> <json_path_lst> <output_path_lst> <input_rate(1/k)> <tmp_path>" << std::endl;
-        return -1;
+    if (argc >= 6 && std::string(argv[1]) == "--video") {
+        WaterFillingParams params;
+        params.warm_start = true;
+        PipelineOptions pipeline;
+        std::unique_ptr<SnapshotSink> snapshot_sink;
+        float rate;
+        if (!parse_rate(argv[5], rate) || !parse_options(argc, argv, 6, params, pipeline, snapshot_sink)) {
+            print_usage();
+            return -1;
+        }
+        return run_video(argv[2], argv[3], argv[4], rate, params);
     }
 
-    const fs::path image_path_lst = argv[1];
-    const fs::path json_path_lst = argv[2];
-    const fs::path output_path_lst = argv[3];
-    const std::string input_rate = argv[4];
-    const fs::path tmp_path = argv[5];
-
-    auto image_paths = get_list_of_file_paths(image_path_lst);
-    auto json_paths = get_list_of_file_paths(json_path_lst);
-    auto output_paths = get_list_of_file_paths(output_path_lst);
-    auto tmp_paths = get_list_of_file_paths(tmp_path);
-
-    std::ofstream timings_file("timings.csv"); // создаёт файл при запуске
-    if (!timings_file.is_open()) {
-        std::cerr << "Failed to open timings file for writing." << std::endl;
+    if (argc >= 4 && std::string(argv[1]) == "--serve") {
+        WaterFillingParams params;
+        PipelineOptions pipeline;
+        std::unique_ptr<SnapshotSink> snapshot_sink;
+        float rate;
+        if (!parse_rate(argv[3], rate) || !parse_options(argc, argv, 4, params, pipeline, snapshot_sink)) {
+            print_usage();
+            return -1;
+        }
+#ifndef _WIN32
+        return run_server(argv[2], rate, params, pipeline);
+#else
+        std::cerr << "--serve needs Unix domain sockets and is not available on Windows" << std::endl;
         return -1;
+#endif
     }
-    timings_file << "filename,k,duration_sec\n";
 
-    for (int i = 0; i < image_paths.size(); i++)
-    {
-        // Загружаем изображение и json
-        const cv::Mat img = cv::imread(image_paths[i], cv::IMREAD_COLOR);
-        if (img.empty()) {
-            std::cerr << "Image not found: " << image_paths[i] << std::endl;
+    if (argc >= 7 && std::string(argv[1]) == "--make-manifest") {
+        // перевод списков в манифест: JSON с точками читаются один раз здесь
+        try {
+            std::vector<ManifestEntry> entries = entries_from_lists(
+                get_list_of_file_paths(argv[2]), get_list_of_file_paths(argv[3]),
+                get_list_of_file_paths(argv[4]), get_list_of_file_paths(argv[5]));
+            std::vector<fs::path> gt_paths, gt_json_paths;
+            if (argc >= 9) {
+                gt_paths = get_list_of_file_paths(argv[7]);
+                gt_json_paths = get_list_of_file_paths(argv[8]);
+                if (gt_paths.size() != entries.size() || gt_json_paths.size() != entries.size()) {
+                    throw std::runtime_error("gt lists differ in length from the image list");
+                }
+            }
+            for (size_t i = 0; i < entries.size(); i++) {
+                entries[i].points = loadPolygonROIFromJson(entries[i].json);
+                if (!gt_paths.empty()) {
+                    entries[i].gt = gt_paths[i];
+                    entries[i].gt_points = loadPolygonROIFromJson(gt_json_paths[i]);
+                }
+            }
+            save_manifest(argv[6], entries);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
             return -1;
         }
+        return 0;
+    }
 
-        // Делаем кроп
-        // Загружаем 4 точки
-        std::vector<cv::Point2f> roi_pts = loadPolygonROIFromJson(json_paths[i]);
+    const bool manifest_mode = argc >= 4 && std::string(argv[1]) == "--manifest";
+    if (argc < 6 && !manifest_mode) {
+        print_usage();
+        return -1;
+    }
 
-        // Получаем выровненный кроп
-        cv::Mat img_crop = cropAndAlignByPolygon(img, roi_pts);
+    WaterFillingParams params;
+    PipelineOptions pipeline;
+    std::unique_ptr<SnapshotSink> snapshot_sink;
+    float rate;
+    if (!parse_rate(manifest_mode ? argv[3] : argv[4], rate)
+        || !parse_options(argc, argv, manifest_mode ? 4 : 6, params, pipeline, snapshot_sink)) {
+        print_usage();
+        return -1;
+    }
 
-        const clock_t start = clock();
+    std::vector<ManifestEntry> entries;
+    try {
+        if (manifest_mode) {
+            entries = load_manifest(argv[2]);
+        } else {
+            entries = entries_from_lists(get_list_of_file_paths(argv[1]), get_list_of_file_paths(argv[2]),
+                                         get_list_of_file_paths(argv[3]), get_list_of_file_paths(argv[5]));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    if (pipeline.shard_count > 1) {
+        std::vector<ManifestEntry> shard;
+        for (size_t i = pipeline.shard_index; i < entries.size(); i += pipeline.shard_count) {
+            shard.push_back(std::move(entries[i]));
+        }
+        entries = std::move(shard);
+    }
 
-        // Удаляем тень
-        const cv::Mat result = removeShadowWaterFilling(img_crop, std::stof(input_rate), tmp_paths[i]);
-        const int input_k = 1/std::stof(input_rate);
+    std::ofstream timings_file("timings.csv"); // создаёт файл при запуске
+    if (!timings_file.is_open()) {
+        std::cerr << "Failed to open timings file for writing." << std::endl;
+        return -1;
+    }
+    // *_wall - настенное время этапа, *_cpu - процессорное время потока этапа, сек;
+    // total - сумма этапов без ожидания в очередях конвейера
+    timings_file << "filename,k,duration_sec,wf_iterations,wf_coarse_iterations,if_iterations,"
+                    "wf_bytes_per_iter,if_bytes_per_iter";
+    for (const char* stage : {"decode", "roi", "warp", "downsample", "water_filling", "incre_filling",
+                              "upsample", "merge", "encode", "total"}) {
+        timings_file << "," << stage << "_wall," << stage << "_cpu";
+    }
+    timings_file << ",cache_hit,predicted_sec\n";
 
-        const double duration = (clock() - start) / static_cast<double>(CLOCKS_PER_SEC);
-        std::cout << "time: " << duration  << " sec" << std::endl;
-        timings_file << image_paths[i].filename() << ","
-                 << input_k << ","
-                 << duration << "\n";
-        // Сохраняем
-        cv::imwrite(output_paths[i], result);
+    try {
+        return run_pipeline(entries, rate, params, pipeline, timings_file);
+    } catch (const std::exception& e) {
+        // опции заданий, кеш и модель времени разбираются и создаются до запуска конвейера
+        std::cerr << e.what() << std::endl;
+        return -1;
     }
-    return 0;
 }
@@ -0,0 +1,189 @@
+#include "manifest.h"
+
+#include <nlohmann/json.hpp>
+#include <fstream>
+#include <stdexcept>
+
+using json = nlohmann::json;
+
+// [{"x": .., "y": ..}, ...] -> точки; ровно 4, как в loadPolygonROIFromJson
+static std::vector<cv::Point2f> points_from_json(const json& j)
+{
+	std::vector<cv::Point2f> points;
+	for (const auto& pt : j)
+	{
+		points.emplace_back(pt.at("x").get<float>(), pt.at("y").get<float>());
+	}
+	if (points.size() != 4)
+	{
+		throw std::runtime_error("expected 4 points");
+	}
+	return points;
+}
+
+static json points_to_json(const std::vector<cv::Point2f>& points)
+{
+	json j = json::array();
+	for (const cv::Point2f& pt : points)
+	{
+		j.push_back({{"x", pt.x}, {"y", pt.y}});
+	}
+	return j;
+}
+
+// путь из манифеста: относительный - от каталога манифеста, как в .lst
+static fs::path path_from_json(const json& j, const char* key, const fs::path& directory)
+{
+	const auto it = j.find(key);
+	if (it == j.end())
+	{
+		return {};
+	}
+	const fs::path path = it->get<std::string>();
+	return path.is_absolute() ? path : directory / path;
+}
+
+ManifestEntry entry_from_json(const json& j, const fs::path& directory)
+{
+	ManifestEntry entry;
+	entry.image = path_from_json(j, "image", directory);
+	entry.output = path_from_json(j, "output", directory);
+	if (j.contains("points"))
+	{
+		entry.points = points_from_json(j["points"]);
+	}
+	entry.json = path_from_json(j, "json", directory);
+	entry.tmp = path_from_json(j, "tmp", directory);
+	entry.rate = j.value("rate", 0.f);
+	entry.options = j.value("options", std::vector<std::string>());
+
+	entry.gt = path_from_json(j, "gt", directory);
+	if (j.contains("gt_points"))
+	{
+		entry.gt_points = points_from_json(j["gt_points"]);
+	}
+	entry.gt_json = path_from_json(j, "gt_json", directory);
+	return entry;
+}
+
+std::vector<ManifestEntry> load_manifest(const fs::path& path)
+{
+	std::ifstream in(path);
+	if (!in.is_open())
+	{
+		throw std::runtime_error("Unable to open manifest: " + path.string());
+	}
+
+	const fs::path directory = path.parent_path();
+	std::vector<ManifestEntry> entries;
+	std::string line;
+	for (int number = 1; std::getline(in, line); number++)
+	{
+		const size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == '#')
+		{
+			continue;
+		}
+		try
+		{
+			ManifestEntry entry = entry_from_json(json::parse(line), directory);
+			if (entry.image.empty() || entry.output.empty())
+			{
+				throw std::runtime_error("\"image\" and \"output\" are required");
+			}
+			if (entry.points.empty() && entry.json.empty())
+			{
+				throw std::runtime_error("either \"points\" or \"json\" is required");
+			}
+			entries.push_back(std::move(entry));
+		} catch (const std::exception& e)
+		{
+			throw std::runtime_error(path.string() + ":" + std::to_string(number) + ": " + e.what());
+		}
+	}
+	return entries;
+}
+
+void save_manifest(const fs::path& path, const std::vector<ManifestEntry>& entries)
+{
+	std::ofstream out(path);
+	if (!out.is_open())
+	{
+		throw std::runtime_error("Unable to open manifest for writing: " + path.string());
+	}
+
+	// абсолютные пути остаются абсолютными, относительные пересчитываются от каталога манифеста
+	const fs::path directory = fs::absolute(path).parent_path();
+	const auto relative = [&](const fs::path& p) {
+		return p.is_absolute() ? p.generic_string() : fs::proximate(fs::absolute(p), directory).generic_string();
+	};
+	for (const ManifestEntry& entry : entries)
+	{
+		json j;
+		j["image"] = relative(entry.image);
+		if (!entry.points.empty())
+		{
+			j["points"] = points_to_json(entry.points);
+		} else
+		{
+			j["json"] = relative(entry.json);
+		}
+		j["output"] = relative(entry.output);
+		if (!entry.tmp.empty())
+		{
+			// префикс, а не каталог: завершающий '/' должен сохраниться
+			std::string tmp = relative(entry.tmp);
+			if (!entry.tmp.has_filename() && tmp.back() != '/')
+			{
+				tmp += '/';
+			}
+			j["tmp"] = tmp;
+		}
+		if (entry.rate > 0)
+		{
+			j["rate"] = entry.rate;
+		}
+		if (!entry.options.empty())
+		{
+			j["options"] = entry.options;
+		}
+		if (!entry.gt.empty())
+		{
+			j["gt"] = relative(entry.gt);
+		}
+		if (!entry.gt_points.empty())
+		{
+			j["gt_points"] = points_to_json(entry.gt_points);
+		} else if (!entry.gt_json.empty())
+		{
+			j["gt_json"] = relative(entry.gt_json);
+		}
+		out << j.dump() << "\n";
+	}
+}
+
+std::vector<ManifestEntry> entries_from_lists(const std::vector<fs::path>& images, const std::vector<fs::path>& jsons,
+	const std::vector<fs::path>& outputs, const std::vector<fs::path>& tmps)
+{
+	// иначе при рассинхронизации списков изображения молча получают чужие ROI и выходы
+	if (jsons.size() != images.size() || outputs.size() != images.size()
+		|| (!tmps.empty() && tmps.size() != images.size()))
+	{
+		throw std::runtime_error("List files differ in length: " + std::to_string(images.size()) + " images, "
+			+ std::to_string(jsons.size()) + " json, " + std::to_string(outputs.size()) + " outputs, "
+			+ std::to_string(tmps.size()) + " tmp");
+	}
+
+	std::vector<ManifestEntry> entries(images.size());
+	for (size_t i = 0; i < images.size(); i++)
+	{
+		entries[i].image = images[i];
+		entries[i].json = jsons[i];
+		entries[i].output = outputs[i];
+		if (!tmps.empty())
+		{
+			entries[i].tmp = tmps[i];
+		}
+	}
+	return entries;
+}
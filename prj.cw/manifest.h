@@ -0,0 +1,49 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <opencv2/opencv.hpp>
+#include <nlohmann/json.hpp>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Одно задание: вход, ROI, выход и параметры. Общий формат для main_cw и calculate_metric.
+// Манифест - JSONL, одна строка на изображение, например
+// {"image": "photos/1.JPG", "points": [{"x": 10, "y": 2000}, ...], "output": "output/k5/1_res.jpg",
+//  "tmp": "tmp/1_", "rate": 0.2, "options": ["--if-iters=50"], "gt": "gt/gt_1.JPG", "gt_points": [...]}
+// Относительные пути считаются от каталога манифеста. Вместо "points" можно указать "json" -
+// путь к JSON с точками, как в json_lst (то же для "gt_points" / "gt_json").
+struct ManifestEntry {
+	fs::path image;
+	std::vector<cv::Point2f> points;   // 4 точки ROI; пусто - читать из json
+	fs::path json;
+	fs::path output;
+	fs::path tmp;                      // префикс снимков
+	float rate = 0;                    // 0 - из командной строки
+	std::vector<std::string> options;  // --key=value поверх общих параметров решателя
+
+	// эталон для calculate_metric
+	fs::path gt;
+	std::vector<cv::Point2f> gt_points;
+	fs::path gt_json;
+};
+
+// Задание из одного объекта манифеста без проверки обязательных полей (их проверяет
+// load_manifest); используется и для запросов main_cw --serve
+ManifestEntry entry_from_json(const nlohmann::json& j, const fs::path& directory);
+
+// Читает манифест целиком; ошибки - std::runtime_error с номером строки.
+// Пустые строки и строки, начинающиеся с '#', пропускаются.
+std::vector<ManifestEntry> load_manifest(const fs::path& path);
+
+// Пишет манифест, пути - относительно его каталога
+void save_manifest(const fs::path& path, const std::vector<ManifestEntry>& entries);
+
+// Задания из параллельных списков (image, json, output, tmp); списки должны быть одной длины.
+// Пустой список tmp допускается.
+std::vector<ManifestEntry> entries_from_lists(const std::vector<fs::path>& images, const std::vector<fs::path>& jsons,
+	const std::vector<fs::path>& outputs, const std::vector<fs::path>& tmps);
+
+#endif // MANIFEST_H
@@ -0,0 +1,253 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+// Версия алгоритма в ключе: при изменении решателя, его входа или формата кеша меняется,
+// и старые записи перестают совпадать (v3 - уменьшенный Y выбирается прямо из исходного изображения)
+static const char* const algorithm_version = "water-filling/incre-filling warped-luma v3";
+
+namespace {
+
+// Два независимых 64-битных хеша по 8-байтовым словам: быстрее побайтового FNV на кропах
+// в десятки мегабайт, 128 бит хватает, чтобы случайные совпадения не встречались
+struct Hash128 {
+	uint64_t a = 0x243f6a8885a308d3;
+	uint64_t b = 0x13198a2e03707344;
+
+	void word(const uint64_t w)
+	{
+		a = (a ^ w) * 0x9e3779b97f4a7c15;
+		a ^= a >> 32;
+		b = (b + w) * 0xc2b2ae3d27d4eb4f;
+		b ^= b >> 29;
+	}
+
+	void bytes(const void* data, size_t size)
+	{
+		const unsigned char* p = static_cast<const unsigned char*>(data);
+		word(size);
+		for (; size >= 8; p += 8, size -= 8)
+		{
+			uint64_t w;
+			std::memcpy(&w, p, 8);
+			word(w);
+		}
+		if (size > 0)
+		{
+			uint64_t w = 0;
+			std::memcpy(&w, p, size);
+			word(w);
+		}
+	}
+
+	template <class T>
+	void value(const T& v)
+	{
+		bytes(&v, sizeof(v));
+	}
+
+	static uint64_t finalize(uint64_t h)
+	{
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccd;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53;
+		h ^= h >> 33;
+		return h;
+	}
+
+	std::string hex() const
+	{
+		static const char digits[] = "0123456789abcdef";
+		std::string out;
+		for (const uint64_t h : {finalize(a), finalize(b ^ a)})
+		{
+			for (int shift = 60; shift >= 0; shift -= 4)
+			{
+				out.push_back(digits[(h >> shift) & 0xf]);
+			}
+		}
+		return out;
+	}
+};
+
+}
+
+std::string result_cache_key(const cv::Mat& crop, const cv::Mat& luma_low, const std::vector<cv::Point2f>& polygon,
+	const float rate, const WaterFillingParams& params, const std::string& format)
+{
+	Hash128 h;
+	h.bytes(algorithm_version, std::strlen(algorithm_version));
+	h.bytes(format.data(), format.size());
+	h.value(rate);
+
+	h.value(params.kernel);
+	h.value(params.precision);
+	h.value(params.neta);
+	h.value(params.brightness);
+	h.value(params.wf_iterations);
+	h.value(params.if_iterations);
+	h.value(params.if_solver);
+	h.value(params.if_adi_steps);
+	h.value(params.wf_tolerance);
+	h.value(params.if_tolerance);
+	h.value(params.wf_levels);
+	h.value(params.wf_refine_iterations);
+	h.value(params.if_low_res);
+	h.value(params.warm_start);
+	h.value(params.wf_warm_iterations);
+	h.value(params.if_warm_iterations);
+	h.value(params.tile_size);
+
+	for (const cv::Point2f& pt : polygon)
+	{
+		h.value(pt.x);
+		h.value(pt.y);
+	}
+
+	for (const cv::Mat* plane : {&crop, &luma_low})
+	{
+		h.value(plane->rows);
+		h.value(plane->cols);
+		h.value(plane->type());
+		const size_t row_bytes = plane->cols * plane->elemSize();
+		for (int y = 0; y < plane->rows; y++)
+		{
+			h.bytes(plane->ptr(y), row_bytes);
+		}
+	}
+	return h.hex();
+}
+
+ResultCache::ResultCache(const fs::path& directory, const uintmax_t max_bytes)
+	: directory_(directory), max_bytes_(max_bytes)
+{
+	fs::create_directories(directory_);
+
+	// порядок с прошлых запусков: по времени последнего использования
+	std::vector<std::pair<fs::file_time_type, std::string>> found;
+	for (const fs::directory_entry& item : fs::directory_iterator(directory_))
+	{
+		if (item.is_regular_file() && item.path().extension() == ".tmp")
+		{
+			// недописанная запись прошлого запуска
+			std::error_code error;
+			fs::remove(item.path(), error);
+		} else if (item.is_regular_file() && item.path().extension() == ".bin")
+		{
+			const std::string key = item.path().stem().string();
+			entries_[key] = Entry{order_.end(), item.file_size()};
+			total_bytes_ += item.file_size();
+			found.emplace_back(item.last_write_time(), key);
+		}
+	}
+	std::sort(found.begin(), found.end(), [](const auto& l, const auto& r) { return l.first > r.first; });
+	for (const auto& [time, key] : found)
+	{
+		entries_[key].position = order_.insert(order_.end(), key);
+	}
+
+	// лимит мог уменьшиться с прошлого запуска
+	while (total_bytes_ > max_bytes_ && !order_.empty())
+	{
+		erase(order_.back());
+	}
+}
+
+fs::path ResultCache::file(const std::string& key) const
+{
+	return directory_ / (key + ".bin");
+}
+
+void ResultCache::erase(const std::string& key)
+{
+	const auto it = entries_.find(key);
+	if (it == entries_.end())
+	{
+		return;
+	}
+	std::error_code error;
+	fs::remove(file(key), error);
+	total_bytes_ -= it->second.size;
+	order_.erase(it->second.position);
+	entries_.erase(it);
+}
+
+std::optional<std::vector<uchar>> ResultCache::get(const std::string& key)
+{
+	std::lock_guard lock(mutex_);
+	const auto it = entries_.find(key);
+	if (it == entries_.end())
+	{
+		misses_++;
+		return std::nullopt;
+	}
+
+	std::ifstream in(file(key), std::ios::binary);
+	std::vector<uchar> data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+	if (!in.is_open() || data.size() != it->second.size)
+	{
+		// файл удалили или испортили снаружи
+		erase(key);
+		misses_++;
+		return std::nullopt;
+	}
+
+	hits_++;
+	order_.splice(order_.begin(), order_, it->second.position);
+	std::error_code error;
+	fs::last_write_time(file(key), fs::file_time_type::clock::now(), error);
+	return data;
+}
+
+void ResultCache::put(const std::string& key, const std::vector<uchar>& data)
+{
+	if (data.size() > max_bytes_)
+	{
+		return;
+	}
+	std::lock_guard lock(mutex_);
+	erase(key);
+
+	// через временный файл: при обрыве в кеше не остаётся половины результата
+	const fs::path path = file(key);
+	fs::path tmp = path;
+	tmp += ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary);
+		out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+		if (!out)
+		{
+			return;
+		}
+	}
+	std::error_code error;
+	fs::rename(tmp, path, error);
+	if (error)
+	{
+		fs::remove(tmp, error);
+		return;
+	}
+
+	entries_[key] = Entry{order_.insert(order_.begin(), key), data.size()};
+	total_bytes_ += data.size();
+	while (total_bytes_ > max_bytes_)
+	{
+		erase(order_.back());
+	}
+}
+
+size_t ResultCache::hits() const
+{
+	std::lock_guard lock(mutex_);
+	return hits_;
+}
+
+size_t ResultCache::misses() const
+{
+	std::lock_guard lock(mutex_);
+	return misses_;
+}
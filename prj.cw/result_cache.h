@@ -0,0 +1,56 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "water_filling.h"
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// Ключ результата: хеш (128 бит, hex) пикселей выровненного кропа и уменьшенного Y, который
+// читает решатель (warp_low_res_luma()), их размеров и типов, polygon, rate, формата выхода и
+// всех параметров решателя, от которых зависит результат (в том числе neta и коэффициента
+// яркости), и версии алгоритма. threads, time_block и cache_bytes результат не меняют
+// и в ключ не входят.
+std::string result_cache_key(const cv::Mat& crop, const cv::Mat& luma_low, const std::vector<cv::Point2f>& polygon,
+	float rate, const WaterFillingParams& params, const std::string& format);
+
+// Кеш закодированных результатов на диске: <directory>/<key>.bin.
+// Размер ограничен max_bytes, вытесняются давно не использованные записи (LRU). Порядок
+// использования хранится во времени изменения файлов, поэтому переживает перезапуск.
+// Потокобезопасен.
+class ResultCache {
+public:
+	ResultCache(const fs::path& directory, uintmax_t max_bytes);
+
+	// Содержимое записи или std::nullopt; попадание делает запись самой свежей
+	std::optional<std::vector<uchar>> get(const std::string& key);
+	// Запись больше max_bytes не сохраняется
+	void put(const std::string& key, const std::vector<uchar>& data);
+
+	size_t hits() const;
+	size_t misses() const;
+
+private:
+	struct Entry {
+		std::list<std::string>::iterator position;
+		uintmax_t size;
+	};
+
+	fs::path file(const std::string& key) const;
+	void erase(const std::string& key);
+
+	fs::path directory_;
+	uintmax_t max_bytes_;
+	uintmax_t total_bytes_ = 0;
+	std::list<std::string> order_; // в начале - самые свежие
+	std::unordered_map<std::string, Entry> entries_;
+	size_t hits_ = 0;
+	size_t misses_ = 0;
+	mutable std::mutex mutex_;
+};
+
+#endif // RESULT_CACHE_H
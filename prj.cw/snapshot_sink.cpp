@@ -0,0 +1,65 @@
+#include "snapshot_sink.h"
+
+#include <algorithm>
+#include <fstream>
+
+AsyncImageSink::AsyncImageSink(const size_t max_pending)
+	: max_pending_(std::max<size_t>(max_pending, 1)), worker_(&AsyncImageSink::run, this)
+{
+}
+
+AsyncImageSink::~AsyncImageSink()
+{
+	{
+		std::lock_guard lock(mutex_);
+		stop_ = true;
+	}
+	changed_.notify_all();
+	worker_.join();
+}
+
+void AsyncImageSink::write(const fs::path& path, const char* stage, const int t, cv::Mat G)
+{
+	std::string file = path.string() + stage + "_t=" + std::to_string(t) + ".jpg";
+	std::unique_lock lock(mutex_);
+	changed_.wait(lock, [this] { return queue_.size() < max_pending_; });
+	queue_.push_back({std::move(file), std::move(G)});
+	lock.unlock();
+	changed_.notify_all();
+}
+
+void AsyncImageSink::run()
+{
+	std::unique_lock lock(mutex_);
+	while (true)
+	{
+		changed_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+		if (queue_.empty())
+		{
+			return; // stop_ и очередь дописана
+		}
+		Job job = std::move(queue_.front());
+		queue_.pop_front();
+		lock.unlock();
+		changed_.notify_all();
+
+		cv::imwrite(job.file, job.G);
+		lock.lock();
+	}
+}
+
+void RawDumpSink::write(const fs::path& path, const char* stage, const int t, cv::Mat G)
+{
+	CV_Assert(G.type() == CV_32FC1);
+	const std::string file = path.string() + stage + "_t=" + std::to_string(t) + "_"
+		+ std::to_string(G.cols) + "x" + std::to_string(G.rows) + ".f32";
+	std::ofstream out(file, std::ios::binary);
+	if (!out.is_open())
+	{
+		throw std::runtime_error("Unable to open snapshot file: " + file);
+	}
+	for (int y = 0; y < G.rows; y++)
+	{
+		out.write(reinterpret_cast<const char*>(G.ptr<float>(y)), static_cast<std::streamsize>(G.cols * sizeof(float)));
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef SNAPSHOT_SINK_H
+#define SNAPSHOT_SINK_H
+
+#include <opencv2/opencv.hpp>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// Приёмник промежуточных снимков G из water_filling()/incre_filling().
+// path - префикс файлов текущего изображения, stage - "wf" или "if", t - номер итерации.
+// G - CV_32F и собственная копия снимка, приёмник может хранить её сколько нужно.
+// Вызывается из потока решателя, поэтому не должен делать долгой работы.
+struct SnapshotSink {
+	virtual ~SnapshotSink() = default;
+	virtual void write(const fs::path& path, const char* stage, int t, cv::Mat G) = 0;
+};
+
+// Кодирует снимки в JPEG в фоновом потоке: <path><stage>_t=<t>.jpg.
+// Если в очереди уже max_pending снимков, write() ждёт. Деструктор дописывает очередь.
+class AsyncImageSink : public SnapshotSink {
+public:
+	explicit AsyncImageSink(size_t max_pending = 8);
+	~AsyncImageSink() override;
+
+	void write(const fs::path& path, const char* stage, int t, cv::Mat G) override;
+
+private:
+	struct Job {
+		std::string file;
+		cv::Mat G;
+	};
+
+	void run();
+
+	size_t max_pending_;
+	std::deque<Job> queue_;
+	std::mutex mutex_;
+	std::condition_variable changed_;
+	bool stop_ = false;
+	std::thread worker_;
+};
+
+// Сырые float-плоскости без заголовка: <path><stage>_t=<t>_<cols>x<rows>.f32,
+// строки подряд, little-endian. Файл можно открыть через mmap / numpy.memmap.
+class RawDumpSink : public SnapshotSink {
+public:
+	void write(const fs::path& path, const char* stage, int t, cv::Mat G) override;
+};
+
+#endif //SNAPSHOT_SINK_H
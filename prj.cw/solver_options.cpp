@@ -0,0 +1,70 @@
+#include "solver_options.h"
+
+#include <sstream>
+
+std::vector<int> parse_int_list(const std::string& value) {
+    std::vector<int> out;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            out.push_back(std::stoi(item));
+        }
+    }
+    return out;
+}
+
+bool parse_solver_option(const std::string& key, const std::string& value, WaterFillingParams& params) {
+    if (key == "--threads") {
+        params.threads = std::max(1, std::stoi(value));
+    } else if (key == "--neta") {
+        params.neta = std::stof(value);
+    } else if (key == "--brightness") {
+        params.brightness = std::stof(value);
+    } else if (key == "--wf-iters") {
+        params.wf_iterations = std::stoi(value);
+    } else if (key == "--if-iters") {
+        params.if_iterations = std::stoi(value);
+    } else if (key == "--if-solver") {
+        if (value != "explicit" && value != "adi") {
+            throw std::invalid_argument("unknown incre_filling solver " + value);
+        }
+        params.if_solver = value == "adi" ? IfSolver::Adi : IfSolver::Explicit;
+    } else if (key == "--if-adi-steps") {
+        params.if_adi_steps = std::max(1, std::stoi(value));
+    } else if (key == "--wf-tol") {
+        params.wf_tolerance = std::stof(value);
+    } else if (key == "--if-tol") {
+        params.if_tolerance = std::stof(value);
+    } else if (key == "--wf-levels") {
+        params.wf_levels = std::max(1, std::stoi(value));
+    } else if (key == "--wf-refine-iters") {
+        params.wf_refine_iterations = std::stoi(value);
+    } else if (key == "--if-low-res") {
+        params.if_low_res = value != "0";
+    } else if (key == "--warm-start") {
+        params.warm_start = value != "0";
+    } else if (key == "--wf-warm-iters") {
+        params.wf_warm_iterations = std::stoi(value);
+    } else if (key == "--if-warm-iters") {
+        params.if_warm_iterations = std::stoi(value);
+    } else if (key == "--time-block") {
+        params.time_block = std::max(1, std::stoi(value));
+    } else if (key == "--cache-kb") {
+        params.cache_bytes = static_cast<size_t>(std::stoul(value)) * 1024;
+    } else if (key == "--tile") {
+        params.tile_size = std::max(0, std::stoi(value));
+    } else if (key == "--precision") {
+        if (value != "f32" && value != "q8") {
+            throw std::invalid_argument("unknown precision " + value);
+        }
+        params.precision = value == "q8" ? StatePrecision::Q8_8 : StatePrecision::F32;
+    } else if (key == "--wf-snapshots") {
+        params.wf_snapshot_iterations = parse_int_list(value);
+    } else if (key == "--if-snapshots") {
+        params.if_snapshot_iterations = parse_int_list(value);
+    } else {
+        return false;
+    }
+    return true;
+}
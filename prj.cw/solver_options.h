@@ -0,0 +1,16 @@
+#ifndef SOLVER_OPTIONS_H
+#define SOLVER_OPTIONS_H
+
+#include "water_filling.h"
+
+#include <string>
+#include <vector>
+
+// "100,1500" -> {100, 1500}, пустая строка - пустой список
+std::vector<int> parse_int_list(const std::string& value);
+
+// Параметр решателя --key=value; false - ключ к решателю не относится.
+// Общий для командной строки main_cw, опций заданий в манифесте и bench_cw.
+bool parse_solver_option(const std::string& key, const std::string& value, WaterFillingParams& params);
+
+#endif // SOLVER_OPTIONS_H
@@ -0,0 +1,63 @@
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <ctime>
+#endif
+
+// Время этапа, сек: wall - по steady_clock, cpu - процессорное время потока, выполнявшего этап
+// (работа пула потоков OpenCV при --threads > 1 в cpu не входит)
+struct StageTime {
+	double wall = 0;
+	double cpu = 0;
+
+	StageTime& operator+=(const StageTime& other)
+	{
+		wall += other.wall;
+		cpu += other.cpu;
+		return *this;
+	}
+};
+
+// Процессорное время текущего потока, сек
+inline double thread_cpu_seconds()
+{
+#ifdef _WIN32
+	FILETIME creation, exit, kernel, user;
+	GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user);
+	const auto ticks = [](const FILETIME& t) {
+		return (static_cast<unsigned long long>(t.dwHighDateTime) << 32) | t.dwLowDateTime;
+	};
+	return static_cast<double>(ticks(kernel) + ticks(user)) * 1e-7;
+#else
+	timespec ts{};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return static_cast<double>(ts.tv_sec) + static_cast<double>(ts.tv_nsec) * 1e-9;
+#endif
+}
+
+// Последовательные замеры этапов: lap() возвращает время с прошлого lap() (или с создания)
+class StageTimer {
+public:
+	StageTimer() : wall_(std::chrono::steady_clock::now()), cpu_(thread_cpu_seconds()) {}
+
+	StageTime lap()
+	{
+		const auto wall = std::chrono::steady_clock::now();
+		const double cpu = thread_cpu_seconds();
+		const StageTime elapsed{std::chrono::duration<double>(wall - wall_).count(), cpu - cpu_};
+		wall_ = wall;
+		cpu_ = cpu;
+		return elapsed;
+	}
+
+private:
+	std::chrono::steady_clock::time_point wall_;
+	double cpu_;
+};
+
+#endif //STAGE_TIMER_H
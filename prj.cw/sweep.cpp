@@ -0,0 +1,337 @@
+// Перебор конфигураций решателя по скорости и качеству: набор данных и эталоны читаются и
+// выравниваются один раз, затем для каждой конфигурации сетки (rate и опции решателя)
+// ShadowRemovalEngine::process() считает все кропы в памяти, PSNR/SSIM - тоже в памяти.
+// Результат - все точки и фронт Парето (задержка против качества) в CSV и JSON.
+#include "water_filling.h"
+#include "solver_options.h"
+#include "manifest.h"
+#include "dataset.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+using json = nlohmann::json;
+
+// Выровненный кроп, уменьшенный Y для каждого rate сетки (как на стадии выравнивания main_cw)
+// и эталон, выровненный и приведённый к размеру кропа (как в calculate_metric)
+struct SweepSample {
+    std::string name;
+    cv::Mat crop;
+    std::vector<cv::Mat> luma_low;
+    cv::Mat gt;
+};
+
+// Ось сетки: опция решателя и её значения
+struct SweepAxis {
+    std::string key;
+    std::vector<std::string> values;
+};
+
+struct SweepOptions {
+    std::vector<float> rates{0.2f};
+    std::vector<SweepAxis> axes;
+    int repeats = 1;
+    fs::path csv = "sweep.csv";
+    fs::path json_out = "sweep.json";
+};
+
+struct SweepPoint {
+    float rate = 0;
+    std::vector<std::string> options;
+    double mean_sec = 0;
+    double max_sec = 0;
+    double mean_psnr = 0;
+    double mean_ssim = 0;
+    double wf_iterations = 0;
+    double if_iterations = 0;
+    bool pareto_psnr = false;
+    bool pareto_ssim = false;
+};
+
+std::vector<SweepSample> load_samples(const std::vector<ManifestEntry>& entries, const std::vector<float>& rates) {
+    std::vector<SweepSample> samples;
+    for (const ManifestEntry& entry : entries) {
+        const cv::Mat img = cv::imread(entry.image.string(), cv::IMREAD_COLOR);
+        const cv::Mat gt = cv::imread(entry.gt.string(), cv::IMREAD_COLOR);
+        if (img.empty() || gt.empty()) {
+            throw std::runtime_error("Unable to read " + entry.image.string() + " or its gt");
+        }
+
+        SweepSample sample;
+        sample.name = entry.image.filename().string();
+        cv::Size size;
+        const cv::Mat M = alignByPolygon(entry.points.empty() ? loadPolygonROIFromJson(entry.json.string())
+                                                              : entry.points, size);
+        cv::warpPerspective(img, sample.crop, M, size);
+        for (const float rate : rates) {
+            sample.luma_low.push_back(warp_low_res_luma(img, M, size, rate));
+        }
+
+        sample.gt = cropAndAlignByPolygon(gt, entry.gt_points.empty() ? loadPolygonROIFromJson(entry.gt_json.string())
+                                                                      : entry.gt_points);
+        if (sample.gt.size() != sample.crop.size()) {
+            cv::resize(sample.gt, sample.gt, sample.crop.size());
+        }
+        samples.push_back(std::move(sample));
+    }
+    return samples;
+}
+
+// Декартово произведение осей: по одному значению каждой опции
+std::vector<std::vector<std::string>> grid_options(const std::vector<SweepAxis>& axes) {
+    std::vector<std::vector<std::string>> grid{{}};
+    for (const SweepAxis& axis : axes) {
+        std::vector<std::vector<std::string>> next;
+        for (const std::vector<std::string>& options : grid) {
+            for (const std::string& value : axis.values) {
+                next.push_back(options);
+                next.back().push_back(axis.key + "=" + value);
+            }
+        }
+        grid = std::move(next);
+    }
+    return grid;
+}
+
+SweepPoint run_point(const std::vector<SweepSample>& samples, const size_t rate_index, const float rate,
+                     const std::vector<std::string>& options, const WaterFillingParams& base, const int repeats) {
+    WaterFillingParams params = base;
+    for (const std::string& option : options) {
+        const size_t eq = option.find('=');
+        parse_solver_option(option.substr(0, eq), option.substr(eq + 1), params);
+    }
+
+    SweepPoint point;
+    point.rate = rate;
+    point.options = options;
+    // буферы движка общие для всех кропов конфигурации, как в пакетной обработке main_cw;
+    // первый прогон выделяет память и в замер не входит
+    ShadowRemovalEngine engine(params);
+    engine.process(samples.front().crop, samples.front().luma_low[rate_index], fs::path());
+    for (const SweepSample& sample : samples) {
+        double best = 0;
+        cv::Mat result;
+        SolverStats stats;
+        for (int r = 0; r < repeats; r++) {
+            stats = SolverStats{};
+            StageTimer timer;
+            result = engine.process(sample.crop, sample.luma_low[rate_index], fs::path(), &stats);
+            const double sec = timer.lap().wall;
+            best = r == 0 ? sec : std::min(best, sec);
+        }
+        point.mean_sec += best;
+        point.max_sec = std::max(point.max_sec, best);
+        point.mean_psnr += cv::PSNR(sample.gt, result);
+        point.mean_ssim += getMSSIM(sample.gt, result);
+        point.wf_iterations += stats.wf_iterations;
+        point.if_iterations += stats.if_iterations;
+    }
+    const double n = static_cast<double>(samples.size());
+    point.mean_sec /= n;
+    point.mean_psnr /= n;
+    point.mean_ssim /= n;
+    point.wf_iterations /= n;
+    point.if_iterations /= n;
+    return point;
+}
+
+// Точка на фронте, если нет другой не медленнее и не хуже по качеству, строго лучше хотя бы в одном
+template <class Quality, class Flag>
+void mark_pareto(std::vector<SweepPoint>& points, Quality quality, Flag flag) {
+    for (SweepPoint& p : points) {
+        p.*flag = std::none_of(points.begin(), points.end(), [&](const SweepPoint& q) {
+            return q.mean_sec <= p.mean_sec && q.*quality >= p.*quality &&
+                   (q.mean_sec < p.mean_sec || q.*quality > p.*quality);
+        });
+    }
+}
+
+std::string join(const std::vector<std::string>& items) {
+    std::string out;
+    for (const std::string& item : items) {
+        out += (out.empty() ? "" : " ") + item;
+    }
+    return out.empty() ? "defaults" : out;
+}
+
+json point_json(const SweepPoint& p) {
+    return {
+        {"rate", p.rate},
+        {"k", std::lround(1 / p.rate)},
+        {"options", p.options},
+        {"mean_sec", p.mean_sec},
+        {"max_sec", p.max_sec},
+        {"mean_psnr", p.mean_psnr},
+        {"mean_ssim", p.mean_ssim},
+        {"wf_iterations", p.wf_iterations},
+        {"if_iterations", p.if_iterations},
+    };
+}
+
+std::vector<std::string> split(const std::string& value) {
+    std::vector<std::string> out;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            out.push_back(item);
+        }
+    }
+    return out;
+}
+
+int main(const int argc, char** argv) {
+    SweepOptions options;
+    WaterFillingParams params;
+    fs::path manifest;
+    std::vector<fs::path> lists;
+    try {
+        for (int a = 1; a < argc; a++) {
+            const std::string arg = argv[a];
+            if (arg.rfind("--", 0) != 0) {
+                lists.emplace_back(arg);
+                continue;
+            }
+            const size_t eq = arg.find('=');
+            const std::string key = arg.substr(0, eq);
+            const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+            if (key == "--manifest") {
+                manifest = value;
+            } else if (key == "--rates") {
+                options.rates.clear();
+                for (const std::string& item : split(value)) {
+                    options.rates.push_back(std::stof(item));
+                }
+            } else if (key == "--repeats") {
+                options.repeats = std::max(1, std::stoi(value));
+            } else if (key == "--csv") {
+                options.csv = value;
+            } else if (key == "--json") {
+                options.json_out = value;
+            } else if (key == "--wf-snapshots" || key == "--if-snapshots" || key == "--snapshots"
+                       || key == "--warm-start") {
+                // тёплый старт продолжил бы повтор с решения прошлого прогона того же кропа
+                throw std::invalid_argument(key + " is not supported by the sweep");
+            } else {
+                // опция решателя; несколько значений через запятую - ось сетки
+                const std::vector<std::string> values = split(value);
+                WaterFillingParams check;
+                for (const std::string& v : values.empty() ? std::vector<std::string>{value} : values) {
+                    if (!parse_solver_option(key, v, check)) {
+                        throw std::invalid_argument("unknown option " + arg);
+                    }
+                }
+                if (values.size() > 1) {
+                    options.axes.push_back({key, values});
+                } else {
+                    parse_solver_option(key, value, params);
+                }
+            }
+        }
+        if (options.rates.empty() || (manifest.empty() && lists.size() != 4)) {
+            throw std::invalid_argument("expected --manifest or four list files");
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n"
+                  << "Usage: sweep_cw <img_lst> <json_lst> <gt_lst> <gt_json_lst> [options]\n"
+                     "       sweep_cw --manifest=<manifest.jsonl> [options]\n"
+                     "Options: [--rates=0.2,0.1] [--repeats=N] [--csv=sweep.csv] [--json=sweep.json]"
+                     " [solver options; comma-separated values form grid axes, e.g. --wf-iters=500,2500"
+                     " --if-solver=explicit,adi --precision=f32,q8]"
+                  << std::endl;
+        return -1;
+    }
+
+    std::vector<SweepSample> samples;
+    try {
+        std::vector<ManifestEntry> entries;
+        if (!manifest.empty()) {
+            entries = load_manifest(manifest);
+        } else {
+            const std::vector<fs::path> images = get_list_of_file_paths(lists[0]);
+            entries = entries_from_lists(images, get_list_of_file_paths(lists[1]),
+                                         std::vector<fs::path>(images.size()), {});
+            const std::vector<fs::path> gts = get_list_of_file_paths(lists[2]);
+            const std::vector<fs::path> gt_jsons = get_list_of_file_paths(lists[3]);
+            if (gts.size() != entries.size() || gt_jsons.size() != entries.size()) {
+                throw std::runtime_error("List files differ in length");
+            }
+            for (size_t i = 0; i < entries.size(); i++) {
+                entries[i].gt = gts[i];
+                entries[i].gt_json = gt_jsons[i];
+            }
+        }
+        for (const ManifestEntry& entry : entries) {
+            if (entry.gt.empty() || (entry.gt_points.empty() && entry.gt_json.empty())) {
+                throw std::runtime_error("No gt or gt ROI for " + entry.image.string());
+            }
+        }
+        StageTimer timer;
+        samples = load_samples(entries, options.rates);
+        std::cout << "loaded " << samples.size() << " images in " << std::fixed << std::setprecision(1)
+                  << timer.lap().wall << " s" << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    if (samples.empty()) {
+        std::cerr << "No images" << std::endl;
+        return -1;
+    }
+
+    const std::vector<std::vector<std::string>> grid = grid_options(options.axes);
+    std::vector<SweepPoint> points;
+    std::cout << std::right << std::setw(4) << "k" << std::setw(12) << "mean_ms" << std::setw(10) << "psnr"
+              << std::setw(9) << "ssim" << "  options" << "\n";
+    for (size_t r = 0; r < options.rates.size(); r++) {
+        for (const std::vector<std::string>& config : grid) {
+            points.push_back(run_point(samples, r, options.rates[r], config, params, options.repeats));
+            const SweepPoint& p = points.back();
+            std::cout << std::setw(4) << std::lround(1 / p.rate) << std::fixed << std::setprecision(2)
+                      << std::setw(12) << p.mean_sec * 1e3 << std::setw(10) << p.mean_psnr << std::setprecision(4)
+                      << std::setw(9) << p.mean_ssim << "  " << join(p.options) << std::endl;
+        }
+    }
+    mark_pareto(points, &SweepPoint::mean_psnr, &SweepPoint::pareto_psnr);
+    mark_pareto(points, &SweepPoint::mean_ssim, &SweepPoint::pareto_ssim);
+
+    // все точки, по возрастанию задержки; фронт - отметками в столбцах pareto_*
+    std::sort(points.begin(), points.end(),
+              [](const SweepPoint& l, const SweepPoint& r) { return l.mean_sec < r.mean_sec; });
+    std::ofstream csv(options.csv);
+    if (!csv.is_open()) {
+        std::cerr << "Unable to write " << options.csv.string() << std::endl;
+        return -1;
+    }
+    csv << "k,options,mean_sec,max_sec,mean_psnr,mean_ssim,wf_iterations,if_iterations,pareto_psnr,pareto_ssim\n";
+    for (const SweepPoint& p : points) {
+        csv << std::lround(1 / p.rate) << "," << join(p.options) << "," << p.mean_sec << "," << p.max_sec << ","
+            << p.mean_psnr << "," << p.mean_ssim << "," << p.wf_iterations << "," << p.if_iterations << ","
+            << p.pareto_psnr << "," << p.pareto_ssim << "\n";
+    }
+    csv.close();
+
+    json report = {{"images", samples.size()}, {"repeats", options.repeats}, {"points", json::array()},
+                   {"pareto_psnr", json::array()}, {"pareto_ssim", json::array()}};
+    std::cout << "\npareto (psnr):\n";
+    for (const SweepPoint& p : points) {
+        report["points"].push_back(point_json(p));
+        if (p.pareto_psnr) {
+            report["pareto_psnr"].push_back(point_json(p));
+            std::cout << std::setw(4) << std::lround(1 / p.rate) << std::setprecision(2) << std::setw(12)
+                      << p.mean_sec * 1e3 << std::setw(10) << p.mean_psnr << "  " << join(p.options) << "\n";
+        }
+        if (p.pareto_ssim) {
+            report["pareto_ssim"].push_back(point_json(p));
+        }
+    }
+    std::ofstream out(options.json_out);
+    if (!out.is_open()) {
+        std::cerr << "Unable to write " << options.json_out.string() << std::endl;
+        return -1;
+    }
+    out << report.dump(2) << "\n";
+    std::cout << "results: " << options.csv.string() << ", " << options.json_out.string() << std::endl;
+    return 0;
+}
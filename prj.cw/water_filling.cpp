@@ -2,6 +2,15 @@
 // Created by danya on 20.06.2025.
 //
 #include "water_filling.h"
+#include "snapshot_sink.h"
+
+#include <algorithm>
+#include <type_traits>
+#include <limits>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 
 // min{input_, 0}
 float inv_relu(const float input_){
@@ -15,160 +24,1782 @@ float inv_relu(const float input_){
 	return output_;
 }
 
-void downsample(cv::Mat src, cv::Mat& dst, const float rate)
+// Плоскость size в левом верхнем углу буфера buf. Буфер перевыделяется, только если
+// плоскость в него не помещается, поэтому для изображений того же или меньшего размера
+// память не выделяется. Результат - ROI, строки не обязательно идут подряд.
+static cv::Mat fit(cv::Mat& buf, const cv::Size size, const int type)
 {
-	src.convertTo(src, CV_32F);
-	const cv::Size size(0, 0);
-	resize(src, dst, size, rate, rate, cv::INTER_LINEAR);
+	if (buf.type() != type || buf.rows < size.height || buf.cols < size.width)
+	{
+		const bool same_type = buf.type() == type;
+		buf.create(std::max(same_type ? buf.rows : 0, size.height), std::max(same_type ? buf.cols : 0, size.width), type);
+	}
+	return buf(cv::Rect(0, 0, size.width, size.height));
 }
 
-cv::Mat water_filling(const cv::Mat& src, const cv::Size original_size, const fs::path& path) {
-	CV_Assert(src.depth() == CV_32F);
+// Хранение состояния: float или фиксированная точка Q8.8 в uint16_t (значение * 256).
+// Вычисления всегда во float, округление и насыщение - при записи.
+static constexpr float q8_scale = 256.f;
+
+static inline float load_value(const float v)
+{
+	return v;
+}
+
+static inline float load_value(const uint16_t v)
+{
+	return static_cast<float>(v) * (1.f / q8_scale);
+}
+
+template <class T>
+static inline T store_value(const float v);
+
+template <>
+inline float store_value<float>(const float v)
+{
+	return v;
+}
+
+template <>
+inline uint16_t store_value<uint16_t>(const float v)
+{
+	return cv::saturate_cast<uint16_t>(v * q8_scale);
+}
+
+template <class T>
+static constexpr int cv_depth()
+{
+	return std::is_same_v<T, float> ? CV_32F : CV_16U;
+}
+
+#if defined(__AVX2__)
+static inline __m256 load8(const float* p)
+{
+	return _mm256_loadu_ps(p);
+}
+
+static inline __m256 load8(const uint16_t* p)
+{
+	const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(v), _mm256_set1_ps(1.f / q8_scale));
+}
+
+static inline void store8(float* p, const __m256 v)
+{
+	_mm256_storeu_ps(p, v);
+}
+
+// значение v после записи в тип T (для Q8.8 - округление и насыщение)
+template <class T>
+static inline __m256 round_trip8(const __m256 v)
+{
+	if constexpr (std::is_same_v<T, float>)
+	{
+		return v;
+	}
+	const __m256 q = _mm256_round_ps(_mm256_mul_ps(v, _mm256_set1_ps(q8_scale)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	const __m256 clamped = _mm256_min_ps(_mm256_max_ps(q, _mm256_setzero_ps()), _mm256_set1_ps(65535.f));
+	return _mm256_mul_ps(clamped, _mm256_set1_ps(1.f / q8_scale));
+}
+
+static inline void store8(uint16_t* p, const __m256 v)
+{
+	const __m256i i = _mm256_cvtps_epi32(_mm256_mul_ps(v, _mm256_set1_ps(q8_scale)));
+	const __m128i packed = _mm_packus_epi32(_mm256_castsi256_si128(i), _mm256_extracti128_si256(i, 1));
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(p), packed);
+}
+#elif defined(__SSE4_1__)
+static inline __m128 load4(const float* p)
+{
+	return _mm_loadu_ps(p);
+}
+
+static inline __m128 load4(const uint16_t* p)
+{
+	const __m128i v = _mm_cvtepu16_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+	return _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set1_ps(1.f / q8_scale));
+}
+
+static inline void store4(float* p, const __m128 v)
+{
+	_mm_storeu_ps(p, v);
+}
+
+template <class T>
+static inline __m128 round_trip4(const __m128 v)
+{
+	if constexpr (std::is_same_v<T, float>)
+	{
+		return v;
+	}
+	const __m128 q = _mm_round_ps(_mm_mul_ps(v, _mm_set1_ps(q8_scale)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	const __m128 clamped = _mm_min_ps(_mm_max_ps(q, _mm_setzero_ps()), _mm_set1_ps(65535.f));
+	return _mm_mul_ps(clamped, _mm_set1_ps(1.f / q8_scale));
+}
+
+static inline void store4(uint16_t* p, const __m128 v)
+{
+	const __m128i i = _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(q8_scale)));
+	_mm_storel_epi64(reinterpret_cast<__m128i*>(p), _mm_packus_epi32(i, i));
+}
+#endif
+
+// Эталонное ядро: одна строка flood/effuse, вычисления в double.
+// Заодно пишет G следующей итерации (g_next = w + s) и его максимум по строке в g_max.
+// Возвращает max |Δw| по строке.
+static float flood_row_scalar(const float* g_up, const float* g, const float* g_dn, const float* s,
+	float* w, float* g_next, const int x_begin, const int x_end, const double neta, const double G_peak,
+	const double decay, float& g_max)
+{
+	float residual = 0;
+
+	for (int x = x_begin; x < x_end; x++)
+	{
+		const double w_pre = w[x];
+
+		// wψ (x0, t) = (ˆh − G(x0, t)) · e−t - flooding process
+		const double pouring = decay * (G_peak - g[x]);
+
+		// min{−G(x0, t) + G(x0 + ∆, t), 0} + min{− G(x0, t) + G(x0 − ∆ , t), 0}. - effusing process
+		const double del_w = neta * (inv_relu(-g[x] + g_dn[x])
+			+ inv_relu(-g[x] + g_up[x])
+			+ inv_relu(-g[x] + g[x + 1])
+			+ inv_relu(-g[x] + g[x - 1]));
+
+		// w(x, t) ≥ 0
+		if (const float temp = del_w + pouring + w_pre; temp < 0)
+		{
+			w[x] = 0;
+		} else
+		{
+			w[x] = temp;
+		}
+		residual = std::max(residual, static_cast<float>(std::abs(w[x] - w_pre)));
+		g_next[x] = w[x] + s[x];
+		g_max = std::max(g_max, g_next[x]);
+	}
+	return residual;
+}
+
+// Пачка клеток строки для шаблонного ядра: float (хвост строки и расчёт без SIMD),
+// __m128 (SSE4.1) и __m256 (AVX2). Ядро написано через эти операции один раз и
+// разворачивается компилятором для каждой ширины и типа хранения T.
+struct Lanes1 {
+	using V = float;
+	static constexpr int width = 1;
+
+	static V set1(const float a) { return a; }
+	template <class T> static V load(const T* p) { return load_value(*p); }
+	template <class T> static void store(T* p, const V v) { *p = store_value<T>(v); }
+	// значение v после записи в тип T (для Q8.8 - округление и насыщение)
+	template <class T> static V round_trip(const V v) { return load_value(store_value<T>(v)); }
+	static V add(const V a, const V b) { return a + b; }
+	static V sub(const V a, const V b) { return a - b; }
+	static V mul(const V a, const V b) { return a * b; }
+	static V min(const V a, const V b) { return std::min(a, b); }
+	static V max(const V a, const V b) { return std::max(a, b); }
+	static V abs(const V a) { return std::abs(a); }
+	static float reduce_max(const V a) { return a; }
+};
+
+#if defined(__AVX2__)
+struct Lanes8 {
+	using V = __m256;
+	static constexpr int width = 8;
+
+	static V set1(const float a) { return _mm256_set1_ps(a); }
+	template <class T> static V load(const T* p) { return load8(p); }
+	template <class T> static void store(T* p, const V v) { store8(p, v); }
+	template <class T> static V round_trip(const V v) { return round_trip8<T>(v); }
+	static V add(const V a, const V b) { return _mm256_add_ps(a, b); }
+	static V sub(const V a, const V b) { return _mm256_sub_ps(a, b); }
+	static V mul(const V a, const V b) { return _mm256_mul_ps(a, b); }
+	static V min(const V a, const V b) { return _mm256_min_ps(a, b); }
+	static V max(const V a, const V b) { return _mm256_max_ps(a, b); }
+	static V abs(const V a) { return _mm256_and_ps(a, _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff))); }
+
+	static float reduce_max(const V a)
+	{
+		alignas(32) float lanes[8];
+		_mm256_store_ps(lanes, a);
+		return *std::max_element(lanes, lanes + 8);
+	}
+};
+using WideLanes = Lanes8;
+#elif defined(__SSE4_1__)
+struct Lanes4 {
+	using V = __m128;
+	static constexpr int width = 4;
+
+	static V set1(const float a) { return _mm_set1_ps(a); }
+	template <class T> static V load(const T* p) { return load4(p); }
+	template <class T> static void store(T* p, const V v) { store4(p, v); }
+	template <class T> static V round_trip(const V v) { return round_trip4<T>(v); }
+	static V add(const V a, const V b) { return _mm_add_ps(a, b); }
+	static V sub(const V a, const V b) { return _mm_sub_ps(a, b); }
+	static V mul(const V a, const V b) { return _mm_mul_ps(a, b); }
+	static V min(const V a, const V b) { return _mm_min_ps(a, b); }
+	static V max(const V a, const V b) { return _mm_max_ps(a, b); }
+	static V abs(const V a) { return _mm_and_ps(a, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))); }
+
+	static float reduce_max(const V a)
+	{
+		alignas(16) float lanes[4];
+		_mm_store_ps(lanes, a);
+		return *std::max_element(lanes, lanes + 4);
+	}
+};
+using WideLanes = Lanes4;
+#endif
+
+// Ограничение разности с соседом G(x + ∆) − G(x):
+// NegativePart - min{·, 0} (inv_relu), вода стекает только к более низким соседям (water_filling),
+// Linear - без ограничения, обычная диффузия (incre_filling).
+struct NegativePart {
+	template <class L>
+	static typename L::V apply(const typename L::V d)
+	{
+		return L::min(d, L::set1(0.f));
+	}
+};
+
+struct Linear {
+	template <class L>
+	static typename L::V apply(const typename L::V d)
+	{
+		return d;
+	}
+};
+
+// Соседство: сумма ограниченных разностей с соседями. Ядро получает строки выше, текущую и ниже,
+// поэтому соседство - в окне 3x3 (на радиусе 1 построены граница и временная блокировка).
+// Cross4 - четыре соседа по осям, как в статье.
+struct Cross4 {
+	template <class L, class Clamp, class T>
+	static typename L::V sum(const T* g_up, const T* g, const T* g_dn, const int x, const typename L::V c)
+	{
+		typename L::V s = Clamp::template apply<L>(L::sub(L::load(g_dn + x), c));
+		s = L::add(s, Clamp::template apply<L>(L::sub(L::load(g_up + x), c)));
+		s = L::add(s, Clamp::template apply<L>(L::sub(L::load(g + x + 1), c)));
+		return L::add(s, Clamp::template apply<L>(L::sub(L::load(g + x - 1), c)));
+	}
+};
+
+// Источник в обновлении w: Pouring - налив (ˆh − G) · e^-t (water_filling), NoSource - его нет
+struct Pouring {
+	static constexpr bool active = true;
+	float peak;
+	float decay;
+
+	template <class L>
+	typename L::V term(const typename L::V c) const
+	{
+		return L::mul(L::set1(decay), L::sub(L::set1(peak), c));
+	}
+};
+
+struct NoSource {
+	static constexpr bool active = false;
+};
+
+// Обновление L::width клеток начиная с x:
+// w = max(neta · Σ Clamp(G(x + ∆) − G(x)) + источник + w, 0), G следующей итерации = w + s.
+// Копит max |Δw| в residual и максимум G следующей итерации в g_max.
+template <class L, class Neighborhood, class Clamp, class Source, class T>
+static inline void stencil_cells(const T* g_up, const T* g, const T* g_dn, const T* s, T* w, T* g_next,
+	const int x, const typename L::V neta, const Source& source, typename L::V& residual, typename L::V& g_max)
+{
+	using V = typename L::V;
+	const V c = L::load(g + x);
+	V update = L::mul(neta, Neighborhood::template sum<L, Clamp>(g_up, g, g_dn, x, c));
+	if constexpr (Source::active)
+	{
+		update = L::add(update, source.template term<L>(c));
+	}
+	const V w_pre = L::load(w + x);
+	const V w_new = L::template round_trip<T>(L::max(L::add(update, w_pre), L::set1(0.f)));
+	L::store(w + x, w_new);
+	residual = L::max(residual, L::abs(L::sub(w_new, w_pre)));
+	const V gn = L::template round_trip<T>(L::add(w_new, L::load(s + x)));
+	L::store(g_next + x, gn);
+	g_max = L::max(g_max, gn);
+}
+
+// Шаблонное ядро строки для обоих решателей: вычисления во float, min/max вместо ветвлений.
+// Клетки [x_begin, x_end) идут самыми широкими пачками, хвост - по одной. Правило (соседство,
+// ограничение, источник) и тип хранения T (float или Q8.8 в uint16_t) известны при компиляции,
+// поэтому каждый вариант - отдельный полностью встроенный цикл. Возвращает max |Δw| по строке.
+template <class Neighborhood, class Clamp, class Source, class T>
+static float stencil_row(const T* g_up, const T* g, const T* g_dn, const T* s, T* w, T* g_next,
+	const int x_begin, const int x_end, const float neta, const Source& source, float& g_max)
+{
+	float residual = 0;
+	int x = x_begin;
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+	using L = WideLanes;
+	const typename L::V v_neta = L::set1(neta);
+	typename L::V v_res = L::set1(0.f);
+	typename L::V v_max = L::set1(g_max);
+	for (; x + L::width <= x_end; x += L::width)
+	{
+		stencil_cells<L, Neighborhood, Clamp>(g_up, g, g_dn, s, w, g_next, x, v_neta, source, v_res, v_max);
+	}
+	residual = L::reduce_max(v_res);
+	g_max = L::reduce_max(v_max);
+#endif
+
+	// хвост строки (и весь расчёт без SIMD)
+	for (; x < x_end; x++)
+	{
+		stencil_cells<Lanes1, Neighborhood, Clamp>(g_up, g, g_dn, s, w, g_next, x, neta, source, residual, g_max);
+	}
+	return residual;
+}
+
+// op(L{}, x) для [x_begin, x_end): самыми широкими пачками, хвост - по одной клетке
+template <class Op>
+static void for_each_lane(const int x_begin, const int x_end, const Op& op)
+{
+	int x = x_begin;
+#if defined(__AVX2__) || defined(__SSE4_1__)
+	for (; x + WideLanes::width <= x_end; x += WideLanes::width)
+	{
+		op(WideLanes{}, x);
+	}
+#endif
+	for (; x < x_end; x++)
+	{
+		op(Lanes1{}, x);
+	}
+}
+
+// Клетки, которые ядро не обновляет: lo первых и hi последних строк и столбцов
+// (как в исходной реализации). Они постоянны на всех итерациях.
+struct FixedBorder {
+	static constexpr int lo = 1;
+	static constexpr int hi = 2;
+};
+
+// Правило обновления water_filling: налив с весом e^-t и растекание
+struct FloodRule {
+	using Border = FixedBorder;
+	WfKernel kernel;
+	float neta;
+
+	// обновление не зависит от ˆh, когда e^-t обращается в 0 в точности ядра
+	bool local(const int t) const
+	{
+		const double decay = exp(-t);
+		return kernel == WfKernel::Scalar ? decay == 0 : static_cast<float>(decay) == 0;
+	}
+
+	template <class T>
+	auto row(const int t, const float G_peak) const
+	{
+		// e^-t зависит только от итерации
+		const double decay = exp(-t);
+		const WfKernel k = kernel;
+		const float n = neta;
+		return [=](const T* g_up, const T* g, const T* g_dn, const T* s,
+			T* w, T* g_next, const int x0, const int x1, float& g_max) {
+			// эталонное ядро есть только для float
+			if constexpr (std::is_same_v<T, float>)
+			{
+				if (k == WfKernel::Scalar)
+				{
+					return flood_row_scalar(g_up, g, g_dn, s, w, g_next, x0, x1, n, G_peak, decay, g_max);
+				}
+			}
+			return stencil_row<Cross4, NegativePart>(g_up, g, g_dn, s, w, g_next, x0, x1, n,
+				Pouring{G_peak, static_cast<float>(decay)}, g_max);
+		};
+	}
+};
+
+// Правило обновления incre_filling: чистая диффузия
+struct DiffuseRule {
+	using Border = FixedBorder;
+	float neta;
 
-	const int height_ = src.rows;
-	const int width_ = src.cols;
-	const auto w_ = cv::Mat(height_, width_, CV_32F, cv::Scalar(0, 0, 0));
-	auto G_ = cv::Mat(height_, width_, CV_32F, cv::Scalar(0, 0, 0));
+	bool local(int) const
+	{
+		return true;
+	}
 
-	double G_peak; // ˆh
-	double G_min;
-	const auto w_ptr = reinterpret_cast<float*>(w_.data);
-	const auto G_ptr = reinterpret_cast<float*>(G_.data);
-	const size_t elem_step = w_.step / sizeof(float); // delta
+	template <class T>
+	auto row(int, float) const
+	{
+		const float n = neta;
+		return [n](const T* g_up, const T* g, const T* g_dn, const T* s,
+			T* w, T* g_next, const int x0, const int x1, float& g_max) {
+			return stencil_row<Cross4, Linear>(g_up, g, g_dn, s, w, g_next, x0, x1, n, NoSource{}, g_max);
+		};
+	}
+};
 
-	for (int t = 0; t < 2500; t++) {
-  		G_ = w_ + src;
-		cv::minMaxLoc(G_, &G_min, &G_peak);
-		for (int y = 1; y < (height_ - 2); y++)
+// Делит строки [begin, end) на полосы и выполняет body(y0, y1, band) для каждой полосы.
+// При threads > 1 полосы распределяются по пулу потоков OpenCV.
+// Соседние строки (гало) полосы читает из общего G, который на этот момент уже посчитан целиком.
+template <class Body>
+static void for_each_band(const int begin, const int end, const int bands, Body&& body)
+{
+	if (bands <= 1 || end - begin < 2 * bands)
+	{
+		body(begin, end, 0);
+		return;
+	}
+	cv::parallel_for_(cv::Range(0, bands), [&](const cv::Range& r) {
+		for (int b = r.start; b < r.end; b++)
 		{
-			for (int x = 1; x < (width_ - 2); x++)
+			const int y0 = begin + static_cast<int>(static_cast<int64_t>(end - begin) * b / bands);
+			const int y1 = begin + static_cast<int>(static_cast<int64_t>(end - begin) * (b + 1) / bands);
+			body(y0, y1, b);
+		}
+	}, bands);
+}
+
+// Состояние итераций. w обновляется на месте, G хранится в двух буферах (ping-pong):
+// G_cur - G текущей итерации, G_prev - G предыдущей (её возвращают и пишут в снимки).
+// Один проход по строке обновляет w и сразу пишет G следующей итерации с его максимумом,
+// поэтому внутри цикла нет ни выделений памяти, ни отдельных проходов для G и ˆh.
+// Плоскости - ROI буферов *_buf (см. fit()), поэтому одна рабочая область служит
+// изображениям любого размера не больше уже встреченного без новых выделений памяти.
+struct StencilWorkspace {
+	cv::Mat G_cur, G_prev;
+	cv::Mat G_cur_buf, G_prev_buf;
+	float G_peak = 0;
+	// максимум G по клеткам, которые ядро не обновляет (они постоянны)
+	float border_max = 0;
+
+	// временная блокировка
+	cv::Mat w_next, w_next_buf;
+	std::vector<cv::Mat> scratch;
+
+	// частичные результаты по полосам
+	std::vector<float> band_max;
+	std::vector<float> band_residual;
+	std::vector<double> band_bytes;
+
+	template <class T, class Border>
+	void init(const cv::Mat& src, const cv::Mat& w, const WaterFillingParams& params);
+};
+
+template <class T, class Border>
+void StencilWorkspace::init(const cv::Mat& src, const cv::Mat& w, const WaterFillingParams& params)
+{
+	const int H = src.rows;
+	const int W = src.cols;
+	const int bands = std::max(params.threads, 1);
+	G_cur = fit(G_cur_buf, src.size(), cv_depth<T>());
+	G_prev = fit(G_prev_buf, src.size(), cv_depth<T>());
+	// после прошлого запуска w_next может указывать на буфер w вызывающего
+	w_next.release();
+	band_max.assign(bands, 0.f);
+	band_residual.assign(bands, 0.f);
+	band_bytes.assign(bands, 0.0);
+
+	G_peak = -std::numeric_limits<float>::max();
+	border_max = -std::numeric_limits<float>::max();
+	for (int y = 0; y < H; y++)
+	{
+		const T* w_row = w.ptr<T>(y);
+		const T* s_row = src.ptr<T>(y);
+		T* g_row = G_cur.ptr<T>(y);
+		const bool fixed_row = y < Border::lo || y >= H - Border::hi;
+		for (int x = 0; x < W; x++)
+		{
+			g_row[x] = store_value<T>(load_value(w_row[x]) + load_value(s_row[x]));
+			const float g = load_value(g_row[x]);
+			G_peak = std::max(G_peak, g);
+			if (fixed_row || x < Border::lo || x >= W - Border::hi)
 			{
-				// hyperparameter neta
-				constexpr double neta = 0.2;
+				border_max = std::max(border_max, g);
+			}
+		}
+	}
+	// постоянные клетки должны быть в обоих буферах
+	G_cur.copyTo(G_prev);
+}
 
-				const double w_pre = w_ptr[x + y * elem_step];
+// Оценка трафика памяти одной обычной итерации: чтение G, src и w, запись w и G следующей итерации
+static double plain_iteration_bytes(const cv::Mat& src)
+{
+	return 5.0 * static_cast<double>(src.total()) * src.elemSize();
+}
 
-				// wψ (x0, t) = (ˆh − G(x0, t)) · e−t - flooding process
-				const double pouring = exp(-t) * (G_peak - G_ptr[x + y * elem_step]);
+// Высота полосы для временной блокировки: полоса с гало (w, два G и src) должна помещаться в кэш
+static int time_block_rows(const cv::Mat& src, const WaterFillingParams& params)
+{
+	const size_t row_bytes = 4 * static_cast<size_t>(src.cols) * src.elemSize();
+	const int fit = static_cast<int>(params.cache_bytes / std::max<size_t>(row_bytes, 1));
+	return std::max(fit - 2 * params.time_block, 8);
+}
 
-				// min{−G(x0, t) + G(x0 + ∆, t), 0} + min{− G(x0, t) + G(x0 − ∆ , t), 0}. - effusing process
-				const double del_w = neta * (inv_relu(-G_ptr[x + y * elem_step] + G_ptr[x + (y + 1) * elem_step])
-					+ inv_relu(-G_ptr[x + y * elem_step] + G_ptr[x + (y - 1) * elem_step])
-					+ inv_relu(-G_ptr[x + y * elem_step] + G_ptr[(x + 1) + y * elem_step])
-					+ inv_relu(-G_ptr[x + y * elem_step] + G_ptr[(x - 1) + y * elem_step]));
+// Обычная итерация: один проход по сетке полосами
+template <class T, class Rule>
+static float plain_iteration(const cv::Mat& src, cv::Mat& w_, StencilWorkspace& ws, const int t,
+	const Rule& rule, const WaterFillingParams& params, double& bytes)
+{
+	const int H = src.rows;
+	const int W = src.cols;
+	const auto row_update = rule.template row<T>(t, ws.G_peak);
+	using Border = typename Rule::Border;
 
-				// w(x, t) ≥ 0
-				if (const float temp = del_w + pouring + w_pre; temp < 0)
+	// Обновление w зависит только от G текущего шага, поэтому полосы независимы
+	std::fill(ws.band_residual.begin(), ws.band_residual.end(), 0.f);
+	std::fill(ws.band_max.begin(), ws.band_max.end(), -std::numeric_limits<float>::max());
+	for_each_band(Border::lo, H - Border::hi, params.threads, [&](const int y0, const int y1, const int band) {
+		float residual = 0;
+		float g_max = -std::numeric_limits<float>::max();
+		for (int y = y0; y < y1; y++)
+		{
+			residual = std::max(residual, row_update(ws.G_cur.ptr<T>(y - 1), ws.G_cur.ptr<T>(y),
+				ws.G_cur.ptr<T>(y + 1), src.ptr<T>(y), w_.ptr<T>(y), ws.G_prev.ptr<T>(y),
+				Border::lo, W - Border::hi, g_max));
+		}
+		ws.band_residual[band] = residual;
+		ws.band_max[band] = g_max;
+	});
+
+	std::swap(ws.G_cur, ws.G_prev);
+	ws.G_peak = std::max(ws.border_max, *std::max_element(ws.band_max.begin(), ws.band_max.end()));
+	bytes += plain_iteration_bytes(src);
+	return *std::max_element(ws.band_residual.begin(), ws.band_residual.end());
+}
+
+// Временная блокировка: steps итераций подряд на полосе строк, которая помещается в кэш.
+// Полоса [y0, y1) считается в локальных буферах по области [y0 - steps, y1 + steps),
+// которая сужается на строку с каждой итерацией (перекрывающиеся тайлы), поэтому результат
+// совпадает с steps обычными итерациями. Полосы читают w_, а пишут в w_next, затем буферы меняются.
+// Применимо, только если обновление не зависит от глобальных величин (ˆh).
+template <class T, class Rule>
+static float time_blocked_iterations(const cv::Mat& src, cv::Mat& w_, StencilWorkspace& ws, const int t,
+	const int steps, const Rule& rule, const WaterFillingParams& params, double& bytes)
+{
+	const int H = src.rows;
+	const int W = src.cols;
+	const int band_rows = time_block_rows(src, params);
+	using Border = typename Rule::Border;
+	const int bands = (H + band_rows - 1) / band_rows;
+	const int chunks = std::max(params.threads, 1);
+
+	if (ws.w_next.empty())
+	{
+		ws.w_next = fit(ws.w_next_buf, src.size(), cv_depth<T>());
+	}
+	if (ws.scratch.size() < static_cast<size_t>(3 * chunks))
+	{
+		ws.scratch.resize(3 * chunks);
+	}
+	std::fill(ws.band_residual.begin(), ws.band_residual.end(), 0.f);
+	std::fill(ws.band_max.begin(), ws.band_max.end(), -std::numeric_limits<float>::max());
+	std::fill(ws.band_bytes.begin(), ws.band_bytes.end(), 0.0);
+
+	for_each_band(0, bands, chunks, [&](const int b0, const int b1, const int chunk) {
+		const cv::Size local_size(W, band_rows + 2 * params.time_block);
+		cv::Mat lw = fit(ws.scratch[3 * chunk], local_size, cv_depth<T>());
+		cv::Mat lg_a = fit(ws.scratch[3 * chunk + 1], local_size, cv_depth<T>());
+		cv::Mat lg_b = fit(ws.scratch[3 * chunk + 2], local_size, cv_depth<T>());
+		cv::Mat* lg = &lg_a;
+		cv::Mat* lg_next = &lg_b;
+
+		float residual = 0;
+		float g_max = -std::numeric_limits<float>::max();
+		for (int b = b0; b < b1; b++)
+		{
+			const int y0 = b * band_rows;
+			const int y1 = std::min(y0 + band_rows, H);
+			const int r0 = std::max(y0 - steps, 0);
+			const int r1 = std::min(y1 + steps, H);
+			for (int y = r0; y < r1; y++)
+			{
+				const T* w_row = w_.ptr<T>(y);
+				const T* s_row = src.ptr<T>(y);
+				T* lw_row = lw.ptr<T>(y - r0);
+				T* g_row = lg->ptr<T>(y - r0);
+				for (int x = 0; x < W; x++)
+				{
+					lw_row[x] = w_row[x];
+					g_row[x] = store_value<T>(load_value(w_row[x]) + load_value(s_row[x]));
+				}
+			}
+			lg->rowRange(0, r1 - r0).copyTo(lg_next->rowRange(0, r1 - r0));
+
+			for (int k = 0; k < steps; k++)
+			{
+				// строки, значения которых после шага k ещё точные; у границы изображения область не сужается
+				const int u0 = r0 == 0 ? Border::lo : r0 + k + 1;
+				const int u1 = r1 == H ? H - Border::hi : r1 - k - 1;
+				const bool last = k == steps - 1;
+				const auto row_update = rule.template row<T>(t + k, 0.f);
+				float unused_max = 0;
+				for (int y = u0; y < u1; y++)
 				{
-					w_ptr[x + y * elem_step] = 0;
-				} else
+					const float r = row_update(lg->ptr<T>(y - r0 - 1), lg->ptr<T>(y - r0),
+						lg->ptr<T>(y - r0 + 1), src.ptr<T>(y), lw.ptr<T>(y - r0),
+						lg_next->ptr<T>(y - r0), Border::lo, W - Border::hi, unused_max);
+					if (last && y >= y0 && y < y1)
+					{
+						residual = std::max(residual, r);
+					}
+				}
+				std::swap(lg, lg_next);
+			}
+
+			// G последнего шага, G следующей итерации и новый w для строк полосы
+			lg_next->rowRange(y0 - r0, y1 - r0).copyTo(ws.G_prev.rowRange(y0, y1));
+			for (int y = y0; y < y1; y++)
+			{
+				const T* g_row = lg->ptr<T>(y - r0);
+				T* out_row = ws.G_cur.ptr<T>(y);
+				for (int x = 0; x < W; x++)
+				{
+					out_row[x] = g_row[x];
+					g_max = std::max(g_max, load_value(g_row[x]));
+				}
+			}
+			lw.rowRange(y0 - r0, y1 - r0).copyTo(ws.w_next.rowRange(y0, y1));
+			ws.band_bytes[chunk] += (2.0 * (r1 - r0) + 3.0 * (y1 - y0)) * W * sizeof(T);
+		}
+		ws.band_residual[chunk] = residual;
+		ws.band_max[chunk] = g_max;
+	});
+
+	std::swap(w_, ws.w_next);
+	ws.G_peak = *std::max_element(ws.band_max.begin(), ws.band_max.end());
+	for (const double b : ws.band_bytes)
+	{
+		bytes += b;
+	}
+	return *std::max_element(ws.band_residual.begin(), ws.band_residual.end());
+}
+
+// Куда и на каких итерациях отдавать снимки G (sink == nullptr - снимков нет)
+struct SnapshotHook {
+	SnapshotSink* sink;
+	const fs::path& path;
+	const char* stage;
+	const std::vector<int>& iterations;
+};
+
+// Итерации правила rule над w_ начиная с момента t_begin (w_ может быть тёплым стартом).
+// Возвращает число выполненных итераций, в ws.G_prev остаётся G последней итерации.
+// T - тип хранения src, w_ и G (float или Q8.8 в uint16_t).
+template <class T, class Rule>
+static int stencil_iterations(const cv::Mat& src, cv::Mat& w_, StencilWorkspace& ws, const Rule& rule,
+	const int t_begin, const int max_iterations, const float tolerance, const WaterFillingParams& params,
+	const SnapshotHook& snapshots, double& bytes)
+{
+	CV_Assert(src.depth() == cv_depth<T>() && w_.depth() == cv_depth<T>() && w_.size() == src.size());
+	ws.init<T, typename Rule::Border>(src, w_, params);
+
+	int i = 0;
+	while (i < max_iterations) {
+		const int t = t_begin + i;
+
+		// Когда обновление локально, несколько итераций делаются на полосе без выхода из кэша
+		float residual = 0;
+		int done = 1;
+		if (params.time_block > 1 && rule.local(t) && max_iterations - i > 1)
+		{
+			done = std::min(params.time_block, max_iterations - i);
+			// блок укорачивается так, чтобы момент снимка был последним в блоке
+			for (const int s : snapshots.iterations)
+			{
+				if (snapshots.sink && s >= t && s < t + done)
 				{
-					w_ptr[x + y * elem_step] = temp;
+					done = s - t + 1;
 				}
 			}
+			residual = time_blocked_iterations<T>(src, w_, ws, t, done, rule, params, bytes);
+		} else
+		{
+			residual = plain_iteration<T>(src, w_, ws, t, rule, params, bytes);
 		}
+		i += done;
 
-		if (t == 1500)
+		const int t_last = t + done - 1;
+		if (snapshots.sink && std::ranges::find(snapshots.iterations, t_last) != snapshots.iterations.end())
 		{
-			cv::imwrite(path.string() + "wf_t=1500.jpg", G_);
-		}  else if (t == 100)
+			// convertTo создаёт новую плоскость, её можно отдать приёмнику без копирования
+			cv::Mat G_snapshot;
+			ws.G_prev.convertTo(G_snapshot, CV_32F, 1.0 / (std::is_same_v<T, float> ? 1.0 : q8_scale));
+			snapshots.sink->write(snapshots.path, snapshots.stage, t_last, G_snapshot);
+		}
+
+		// критерий остановки: max |Δw| за итерацию (при блокировке - за последнюю итерацию блока)
+		if (tolerance > 0 && residual < tolerance)
 		{
-			cv::imwrite(path.string() + "wf_t=100.jpg", G_);
+			break;
 		}
 	}
+	return i;
+}
 
-	// upscale
-	cv::Mat output;
-	cv::resize(G_, output, original_size, 0, 0, cv::INTER_LINEAR);
-	output.convertTo(output, CV_8UC1);
+// Плоскость float в типе хранения T и обратно (buf - буфер результата для Q8.8)
+template <class T>
+static cv::Mat to_storage(const cv::Mat& m, cv::Mat& buf)
+{
+	if constexpr (std::is_same_v<T, float>)
+	{
+		return m;
+	}
+	cv::Mat out = fit(buf, m.size(), cv_depth<T>());
+	m.convertTo(out, cv_depth<T>(), q8_scale);
+	return out;
+}
+
+template <class T>
+static cv::Mat from_storage(const cv::Mat& m, cv::Mat& buf)
+{
+	if constexpr (std::is_same_v<T, float>)
+	{
+		return m;
+	}
+	cv::Mat out = fit(buf, m.size(), CV_32F);
+	m.convertTo(out, CV_32F, 1.0 / q8_scale);
+	return out;
+}
+
+// Буферы одного уровня пирамиды water_filling()
+struct LevelBuffers {
+	cv::Mat src;     // уровень пирамиды (для уровня 0 не используется)
+	cv::Mat storage; // уровень в типе хранения
+	cv::Mat w;
+	StencilWorkspace ws;
+};
+
+// Все плоскости water_filling()/incre_filling(); переживают вызовы внутри ShadowRemovalEngine
+struct SolverBuffers {
+	std::vector<cv::Mat> levels;
+	std::vector<LevelBuffers> wf;
+	cv::Mat wf_G, wf_upscaled, wf_output;
+
+	cv::Mat if_input, if_original, if_storage, if_w, if_G, if_ratio, if_output;
+	cv::Mat if_gain, if_gain_up;
+	// неявный incre_filling: рабочая плоскость и коэффициенты прогонки по x и y
+	cv::Mat if_adi_scratch;
+	std::vector<float> adi_cx, adi_mx, adi_cy, adi_my;
+
+	// решения прошлого вызова для тёплого старта (WaterFillingParams::warm_start)
+	cv::Mat wf_last_w, if_last_w;
+	StencilWorkspace if_ws;
+
+	LevelBuffers& level(const size_t l)
+	{
+		if (wf.size() <= l)
+		{
+			wf.resize(l + 1);
+		}
+		return wf[l];
+	}
+};
+
+// Начальное w_ для тёплого старта: копия last, если оно подходит по размеру и типу
+static bool warm_start_from(const cv::Mat& last, cv::Mat& w_)
+{
+	if (last.empty() || last.size() != w_.size() || last.type() != w_.type())
+	{
+		return false;
+	}
+	if (last.data != w_.data)
+	{
+		last.copyTo(w_);
+	}
+	return true;
+}
+
+template <class T>
+static cv::Mat water_filling_impl(const cv::Mat& src, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats, SolverBuffers& b) {
+	const FloodRule rule{params.kernel, params.neta};
+	const SnapshotHook snapshots{params.snapshot_sink, path, "wf", params.wf_snapshot_iterations};
+	const SnapshotHook no_snapshots{nullptr, path, "wf", params.wf_snapshot_iterations};
+
+	// Тёплый старт: налив уже выполнен на прошлом кадре, уточняется только w_ исходного уровня
+	if (params.warm_start)
+	{
+		LevelBuffers& lb = b.level(0);
+		cv::Mat w_ = fit(lb.w, src.size(), cv_depth<T>());
+		if (warm_start_from(b.wf_last_w, w_))
+		{
+			double bytes = 0;
+			const int t = stencil_iterations<T>(to_storage<T>(src, lb.storage), w_, lb.ws, rule, params.wf_iterations,
+				params.wf_warm_iterations, params.wf_tolerance, params, snapshots, bytes);
+			b.wf_last_w = w_;
+			if (stats)
+			{
+				stats->wf_iterations = t;
+				stats->wf_coarse_iterations = 0;
+				stats->wf_bytes_per_iteration = bytes / std::max(t, 1);
+			}
+			return from_storage<T>(lb.ws.G_prev, b.wf_G);
+		}
+	}
+
+	// Пирамида: levels[0] - src, каждый следующий уровень в 2 раза меньше
+	std::vector<cv::Mat>& levels = b.levels;
+	levels.assign(1, src);
+	while (static_cast<int>(levels.size()) < params.wf_levels &&
+		std::min(levels.back().rows, levels.back().cols) >= 16)
+	{
+		const cv::Size size((levels.back().cols + 1) / 2, (levels.back().rows + 1) / 2);
+		cv::Mat next = fit(b.level(levels.size()).src, size, CV_32F);
+		cv::resize(levels.back(), next, size, 0, 0, cv::INTER_AREA);
+		levels.push_back(next);
+	}
+	b.level(levels.size() - 1);
+
+	int coarse_iterations = 0;
+	int t = 0;
+	double bytes = 0;
+	if (levels.size() > 1)
+	{
+		// Самый грубый уровень проходит полный цикл налива и растекания
+		LevelBuffers& coarse = b.wf[levels.size() - 1];
+		cv::Mat w_level = fit(coarse.w, levels.back().size(), cv_depth<T>());
+		w_level.setTo(0);
+		t = stencil_iterations<T>(to_storage<T>(levels.back(), coarse.storage), w_level, coarse.ws, rule, 0,
+			params.wf_iterations, params.wf_tolerance, params, no_snapshots, bytes);
+		coarse_iterations = t;
+
+		// Более мелкие уровни стартуют с увеличенного w_ предыдущего уровня
+		for (int l = static_cast<int>(levels.size()) - 2; l >= 0; l--)
+		{
+			LevelBuffers& lb = b.wf[l];
+			const cv::Mat level_src = to_storage<T>(levels[l], lb.storage);
+			cv::Mat w_up = fit(lb.w, level_src.size(), cv_depth<T>());
+			cv::resize(w_level, w_up, level_src.size(), 0, 0, cv::INTER_LINEAR);
+
+			// граница, которую ядро не обновляет, остаётся сухой, как в одноуровневом решении
+			using Border = FloodRule::Border;
+			w_up.rowRange(0, std::min(Border::lo, level_src.rows)).setTo(0);
+			w_up.rowRange(std::max(level_src.rows - Border::hi, 0), level_src.rows).setTo(0);
+			w_up.colRange(0, std::min(Border::lo, level_src.cols)).setTo(0);
+			w_up.colRange(std::max(level_src.cols - Border::hi, 0), level_src.cols).setTo(0);
+
+			const int done = stencil_iterations<T>(level_src, w_up, lb.ws, rule, t, params.wf_refine_iterations,
+				params.wf_tolerance, params, l == 0 ? snapshots : no_snapshots, bytes);
+			t += done;
+			if (l > 0)
+			{
+				coarse_iterations += done;
+			}
+			w_level = w_up;
+		}
+		t -= coarse_iterations;
+		b.wf_last_w = w_level;
+	} else
+	{
+		LevelBuffers& lb = b.wf[0];
+		cv::Mat w_ = fit(lb.w, src.size(), cv_depth<T>());
+		w_.setTo(0);
+		t = stencil_iterations<T>(to_storage<T>(src, lb.storage), w_, lb.ws, rule, 0, params.wf_iterations,
+			params.wf_tolerance, params, snapshots, bytes);
+		b.wf_last_w = w_;
+	}
+
+	if (stats)
+	{
+		stats->wf_iterations = t;
+		stats->wf_coarse_iterations = coarse_iterations;
+		stats->wf_bytes_per_iteration = bytes / std::max(t + coarse_iterations, 1);
+	}
+
+	return from_storage<T>(b.wf[0].ws.G_prev, b.wf_G);
+}
+
+// Налив и растекание на сетке src, возвращает G (float) того же размера
+static cv::Mat flood_and_effuse(const cv::Mat& src, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats, SolverBuffers& b) {
+	CV_Assert(src.depth() == CV_32F);
+
+	if (params.precision == StatePrecision::Q8_8)
+	{
+		return water_filling_impl<uint16_t>(src, path, params, stats, b);
+	}
+	return water_filling_impl<float>(src, path, params, stats, b);
+}
+
+// upscale G до size и перевод в CV_8U (результат water_filling())
+static cv::Mat upscale(const cv::Mat& G_, const cv::Size size, SolverBuffers& b)
+{
+	cv::Mat upscaled = G_;
+	if (G_.size() != size)
+	{
+		upscaled = fit(b.wf_upscaled, size, CV_32F);
+		cv::resize(G_, upscaled, size, 0, 0, cv::INTER_LINEAR);
+	}
+	cv::Mat output = fit(b.wf_output, size, CV_8U);
+	upscaled.convertTo(output, CV_8UC1);
 	return output;
 }
 
-cv::Mat incre_filling(cv::Mat input, cv::Mat Original, const fs::path& path){
-	input.convertTo(input, CV_32F);
-	Original.convertTo(Original, CV_32F);
+// Прогонка с постоянными коэффициентами для (I - τ·D2) x = d на n неизвестных, где D2 - вторая
+// разность по одной оси, а значения за концами заданы: c - коэффициенты c'_i прямого хода,
+// m - обратные знаменатели. Одни на все строки (столбцы), считаются один раз на шаг.
+static void adi_coefficients(const int n, const float tau, std::vector<float>& c, std::vector<float>& m)
+{
+	c.resize(std::max(n, 0));
+	m.resize(std::max(n, 0));
+	float prev = 0;
+	for (int i = 0; i < n; i++)
+	{
+		m[i] = 1.f / (1 + 2 * tau + tau * prev);
+		c[i] = -tau * m[i];
+		prev = c[i];
+	}
+}
 
-	const int height = input.rows;
-	const int width = input.cols;
-	const auto w_ = cv::Mat(height, width, CV_32F, cv::Scalar(0, 0, 0));
-	auto G_ = cv::Mat(height, width, CV_32F, cv::Scalar(0, 0, 0));
+// Прогонка вдоль R строк с y по n неизвестным с x0. Рекурсия прямого хода последовательна,
+// поэтому строки идут вместе: их независимые цепочки скрывают задержку умножения-сложения.
+template <int R>
+static void adi_sweep_rows(cv::Mat& G, cv::Mat& D, const int y, const int x0, const int n, const float tau,
+	const float* c, const float* m)
+{
+	float* g[R];
+	float* d[R];
+	float prev[R];
+	float right[R];
+	for (int r = 0; r < R; r++)
+	{
+		g[r] = G.ptr<float>(y + r) + x0;
+		d[r] = D.ptr<float>(y + r) + x0;
+		// заданные концы входят в правую часть первого и последнего уравнения
+		prev[r] = g[r][-1];
+		right[r] = tau * g[r][n];
+	}
+	for (int i = 0; i < n; i++)
+	{
+		for (int r = 0; r < R; r++)
+		{
+			prev[r] = (g[r][i] + tau * prev[r]) * m[i];
+			d[r][i] = prev[r];
+		}
+	}
+	for (int r = 0; r < R; r++)
+	{
+		d[r][n - 1] += right[r] * m[n - 1];
+		g[r][n - 1] = d[r][n - 1];
+	}
+	for (int i = n - 2; i >= 0; i--)
+	{
+		for (int r = 0; r < R; r++)
+		{
+			g[r][i] = d[r][i] - c[i] * g[r][i + 1];
+		}
+	}
+}
 
-	const auto w_ptr = reinterpret_cast<float*>(w_.data);
-	const auto G_ptr = reinterpret_cast<float*>(G_.data);
-	const size_t elem_step = w_.step / sizeof(float);
+// Неявный incre_filling (IfSolver::Adi): то же время диффузии neta * iterations, что у явных итераций,
+// за if_adi_steps неявных шагов с расщеплением по осям: прогонка вдоль строк, затем вдоль столбцов,
+// затем проекция G >= input (w >= 0). Шаги устойчивы при любом τ. Неподвижная граница - как у
+// DiffuseRule, её значения входят в прогонку как заданные концы. Строки прогоняются полосами строк,
+// столбцы - полосами столбцов (внутренний цикл по x непрерывен в памяти). Возвращает G (float).
+static cv::Mat incre_adi(const cv::Mat& input_f, const int iterations, const WaterFillingParams& params,
+	SolverStats* stats, SolverBuffers& b)
+{
+	using Border = DiffuseRule::Border;
+	const int H = input_f.rows;
+	const int W = input_f.cols;
+	const int steps = std::max(params.if_adi_steps, 1);
+	const float tau = params.neta * std::max(iterations, 0) / steps;
 
-	for (int t = 0; t < 100; t++){
-		G_ = w_ + input;
-		for (int y = 1; y < (height - 2); y++){
+	cv::Mat G = fit(b.if_G, input_f.size(), CV_32F);
+	input_f.copyTo(G);
+	cv::Mat D = fit(b.if_adi_scratch, input_f.size(), CV_32F);
+	const int x0 = Border::lo, nx = W - Border::lo - Border::hi;
+	const int y0 = Border::lo, ny = H - Border::lo - Border::hi;
+	if (nx > 0 && ny > 0 && tau > 0)
+	{
+		adi_coefficients(nx, tau, b.adi_cx, b.adi_mx);
+		adi_coefficients(ny, tau, b.adi_cy, b.adi_my);
+		const float* cx = b.adi_cx.data();
+		const float* mx = b.adi_mx.data();
+		const float* cy = b.adi_cy.data();
+		const float* my = b.adi_my.data();
 
-			for (int x = 1; x < (width - 2); x++){
-				constexpr double neta = 0.2;
+		for (int step = 0; step < steps; step++)
+		{
+			// вдоль строк
+			for_each_band(y0, y0 + ny, params.threads, [&](const int r0, const int r1, int) {
+				int y = r0;
+				for (; y + 8 <= r1; y += 8)
+				{
+					adi_sweep_rows<8>(G, D, y, x0, nx, tau, cx, mx);
+				}
+				for (; y < r1; y++)
+				{
+					adi_sweep_rows<1>(G, D, y, x0, nx, tau, cx, mx);
+				}
+			});
 
-				const double w_pre = w_ptr[x + y * elem_step];
-				const double del_w = neta * (-G_ptr[x + y * elem_step] + G_ptr[x + (y + 1) * elem_step]
-					+ -G_ptr[x + y * elem_step] + G_ptr[x + (y - 1) * elem_step]
-					+ -G_ptr[x + y * elem_step] + G_ptr[(x + 1) + y * elem_step]
-					+ -G_ptr[x + y * elem_step] + G_ptr[(x - 1) + y * elem_step]);
-				if (const float temp = del_w + w_pre; temp < 0){
-					w_ptr[x + y*elem_step] = 0;
+			// вдоль столбцов пачками по x, затем проекция
+			for_each_band(x0, x0 + nx, params.threads, [&](const int c0, const int c1, int) {
+				for (int i = 0; i < ny; i++)
+				{
+					const float* g = G.ptr<float>(y0 + i);
+					const float* prev = i > 0 ? D.ptr<float>(y0 + i - 1) : G.ptr<float>(y0 - 1);
+					float* d = D.ptr<float>(y0 + i);
+					for_each_lane(c0, c1, [&](auto lanes, const int x) {
+						using L = decltype(lanes);
+						L::store(d + x, L::mul(L::add(L::load(g + x), L::mul(L::set1(tau), L::load(prev + x))),
+							L::set1(my[i])));
+					});
 				}
-				else{
-					w_ptr[x + y*elem_step] = temp;
+				{
+					const float* edge = G.ptr<float>(y0 + ny);
+					float* d = D.ptr<float>(y0 + ny - 1);
+					float* g = G.ptr<float>(y0 + ny - 1);
+					for_each_lane(c0, c1, [&](auto lanes, const int x) {
+						using L = decltype(lanes);
+						const typename L::V v = L::add(L::load(d + x), L::mul(L::set1(tau * my[ny - 1]), L::load(edge + x)));
+						L::store(d + x, v);
+						L::store(g + x, v);
+					});
 				}
+				for (int i = ny - 2; i >= 0; i--)
+				{
+					const float* d = D.ptr<float>(y0 + i);
+					const float* g_dn = G.ptr<float>(y0 + i + 1);
+					float* g = G.ptr<float>(y0 + i);
+					for_each_lane(c0, c1, [&](auto lanes, const int x) {
+						using L = decltype(lanes);
+						L::store(g + x, L::sub(L::load(d + x), L::mul(L::set1(cy[i]), L::load(g_dn + x))));
+					});
+				}
+				for (int y = y0; y < y0 + ny; y++)
+				{
+					const float* src = input_f.ptr<float>(y);
+					float* g = G.ptr<float>(y);
+					for_each_lane(c0, c1, [&](auto lanes, const int x) {
+						using L = decltype(lanes);
+						L::store(g + x, L::max(L::load(g + x), L::load(src + x)));
+					});
+				}
+			});
+		}
+	}
+
+	if (stats)
+	{
+		stats->if_iterations = steps;
+		// на шаг: по 4 прохода плоскостей G/D в каждой прогонке и 3 в проекции
+		stats->if_bytes_per_iteration = 11.0 * static_cast<double>(input_f.total()) * sizeof(float);
+	}
+	return G;
+}
+
+// Диффузия incre_filling: iterations итераций от input, возвращает G (float)
+static cv::Mat incre_diffusion(const cv::Mat& input, const int iterations, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats, SolverBuffers& b){
+	cv::Mat input_f = fit(b.if_input, input.size(), CV_32F);
+	input.convertTo(input_f, CV_32F);
+	if (params.if_solver == IfSolver::Adi)
+	{
+		return incre_adi(input_f, iterations, params, stats, b);
+	}
+
+	const SnapshotHook snapshots{params.snapshot_sink, path, "if", params.if_snapshot_iterations};
+	double bytes = 0;
+	int t;
+	cv::Mat G_;
+
+	// глобальных величин здесь нет, блокировать можно с первой итерации
+	const bool q8 = params.precision == StatePrecision::Q8_8;
+	cv::Mat w_ = fit(b.if_w, input.size(), q8 ? CV_16U : CV_32F);
+	// тёплый старт: w_ прошлого кадра и не более if_warm_iterations итераций
+	const bool warm = params.warm_start && warm_start_from(b.if_last_w, w_);
+	const int n = warm ? std::min(iterations, params.if_warm_iterations) : iterations;
+	if (!warm)
+	{
+		w_.setTo(0);
+	}
+	if (q8)
+	{
+		t = stencil_iterations<uint16_t>(to_storage<uint16_t>(input_f, b.if_storage), w_, b.if_ws, DiffuseRule{params.neta}, 0,
+			n, params.if_tolerance, params, snapshots, bytes);
+		G_ = from_storage<uint16_t>(b.if_ws.G_prev, b.if_G);
+	} else
+	{
+		t = stencil_iterations<float>(input_f, w_, b.if_ws, DiffuseRule{params.neta}, 0, n,
+			params.if_tolerance, params, snapshots, bytes);
+		G_ = b.if_ws.G_prev;
+	}
+	b.if_last_w = w_;
+	if (stats)
+	{
+		stats->if_iterations = t;
+		stats->if_bytes_per_iteration = bytes / std::max(t, 1);
+	}
+	return G_;
+}
+
+static cv::Mat incre_filling(const cv::Mat& input, const cv::Mat& Original, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats, SolverBuffers& b){
+	const cv::Mat G_ = incre_diffusion(input, params.if_iterations, path, params, stats, b);
+	cv::Mat original_f = fit(b.if_original, Original.size(), CV_32F);
+	Original.convertTo(original_f, CV_32F);
+
+	// lim(t→∞) (I(x, y)/ G(x,y,t)) * l, l - коэффициент для изменения яркости выходного изображения, I(x, y) - оригинальное изображение
+	// (то же, что brightness * Original / G_ * 255, но в готовый буфер)
+	cv::Mat ratio = fit(b.if_ratio, input.size(), CV_32F);
+	cv::divide(original_f, G_, ratio, params.brightness * 255.0);
+	cv::Mat output_ = fit(b.if_output, input.size(), CV_8U);
+	ratio.convertTo(output_, CV_8UC1);
+	return output_;
+}
+
+// incre_filling на уменьшенной сетке input: возвращает карту усиления brightness * 255 / G того же
+// размера. Итерации масштабируются на отношение площадей input и исходного изображения (rate²),
+// чтобы диффузия охватывала ту же область исходного изображения.
+static cv::Mat incre_gain_low_res(const cv::Mat& input, const cv::Size original_size, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats, SolverBuffers& b){
+	const double area_ratio = static_cast<double>(input.total()) / std::max(original_size.area(), 1);
+	const int iterations = std::max(1, cvRound(params.if_iterations * area_ratio));
+	const cv::Mat G_ = incre_diffusion(input, iterations, path, params, stats, b);
+
+	cv::Mat gain = fit(b.if_gain, input.size(), CV_32F);
+	cv::divide(params.brightness * 255.0, G_, gain);
+	return gain;
+}
+
+cv::Mat water_filling(const cv::Mat& src, const cv::Size original_size, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats) {
+	SolverBuffers b;
+	return upscale(flood_and_effuse(src, path, params, stats, b), original_size, b);
+}
+
+cv::Mat incre_filling(cv::Mat input, cv::Mat Original, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats){
+	SolverBuffers b;
+	return incre_filling(input, Original, path, params, stats, b);
+}
+
+struct ShadowRemovalEngine::Buffers {
+	cv::Mat luma_row[2];
+	cv::Mat Y_down;
+	SolverBuffers solver;
+	cv::Mat output;
+
+	// тайловый режим
+	cv::Mat G_low;
+	cv::Mat tile_G, tile_G8;
+};
+
+// Выборка cv::resize(INTER_LINEAR) по одной оси: для координаты x результата -
+// левый сосед x0 в источнике размера src_size и вес a правого соседа
+static void linear_tap(const int x, const double scale, const int src_size, int& x0, float& a)
+{
+	const double fx = (x + 0.5) * scale - 0.5;
+	x0 = static_cast<int>(std::floor(fx));
+	a = static_cast<float>(fx - x0);
+	if (x0 < 0)
+	{
+		x0 = 0;
+		a = 0;
+	}
+	if (x0 >= src_size - 1)
+	{
+		x0 = src_size - 1;
+		a = 0;
+	}
+}
+
+// Окно window изображения размера dst_size, полученного билинейным увеличением src (CV_32F).
+// Значение зависит только от глобальных координат пикселя, поэтому соседние тайлы
+// совпадают на стыках.
+static cv::Mat resize_window(const cv::Mat& src, const cv::Size dst_size, const cv::Rect window, cv::Mat& buf)
+{
+	const double scale_x = static_cast<double>(src.cols) / dst_size.width;
+	const double scale_y = static_cast<double>(src.rows) / dst_size.height;
+	std::vector<int> x0(window.width);
+	std::vector<float> ax(window.width);
+	for (int x = 0; x < window.width; x++)
+	{
+		linear_tap(window.x + x, scale_x, src.cols, x0[x], ax[x]);
+	}
+
+	cv::Mat dst = fit(buf, window.size(), CV_32F);
+	for (int y = 0; y < window.height; y++)
+	{
+		int y0;
+		float ay;
+		linear_tap(window.y + y, scale_y, src.rows, y0, ay);
+		const float* r0 = src.ptr<float>(y0);
+		const float* r1 = src.ptr<float>(std::min(y0 + 1, src.rows - 1));
+		float* out = dst.ptr<float>(y);
+		for (int x = 0; x < window.width; x++)
+		{
+			const int x1 = std::min(x0[x] + 1, src.cols - 1);
+			const float top = r0[x0[x]] + ax[x] * (r0[x1] - r0[x0[x]]);
+			const float bottom = r1[x0[x]] + ax[x] * (r1[x1] - r1[x0[x]]);
+			out[x] = top + ay * (bottom - top);
+		}
+	}
+	return dst;
+}
+
+// Y пикселя BGR, как в cv::cvtColor(COLOR_BGR2YCrCb) для CV_8U (коэффициенты 0.299, 0.587, 0.114 в Q14)
+static inline int bgr_luma(const uchar* p)
+{
+	return (p[0] * 1868 + p[1] * 9617 + p[2] * 4899 + (1 << 13)) >> 14;
+}
+
+// Уменьшенный в rate раз Y за один проход по input: яркость считается сразу из BGR только
+// для двух строк, нужных очередной строке результата, без YCrCb и копий каналов
+static cv::Mat low_res_luma(const cv::Mat& input, const float rate, cv::Mat (&rows)[2], cv::Mat& buf)
+{
+	// размер такой же, как у resize с dsize = (0, 0)
+	const cv::Size size(cv::saturate_cast<int>(input.cols * static_cast<double>(rate)),
+		cv::saturate_cast<int>(input.rows * static_cast<double>(rate)));
+	const double scale = 1.0 / rate;
+	std::vector<int> x0(size.width);
+	std::vector<float> ax(size.width);
+	for (int x = 0; x < size.width; x++)
+	{
+		linear_tap(x, scale, input.cols, x0[x], ax[x]);
+	}
+
+	int cached[2] = {-1, -1};
+	const auto luma = [&](const int y, const int slot) -> const float* {
+		cv::Mat row = fit(rows[slot], cv::Size(input.cols, 1), CV_32F);
+		float* out = row.ptr<float>(0);
+		if (cached[slot] != y)
+		{
+			const uchar* p = input.ptr<uchar>(y);
+			for (int x = 0; x < input.cols; x++)
+			{
+				out[x] = static_cast<float>(bgr_luma(p + 3 * x));
 			}
+			cached[slot] = y;
 		}
-		if (t == 10)
+		return out;
+	};
+
+	cv::Mat dst = fit(buf, size, CV_32F);
+	for (int y = 0; y < size.height; y++)
+	{
+		int y0;
+		float ay;
+		linear_tap(y, scale, input.rows, y0, ay);
+		const float* r0 = luma(y0, y0 % 2);
+		const float* r1 = luma(std::min(y0 + 1, input.rows - 1), (y0 + 1) % 2);
+		float* out = dst.ptr<float>(y);
+		for (int x = 0; x < size.width; x++)
 		{
-			cv::imwrite(path.string() + "if_t=15.jpg", G_);
-		} else if (t == 50)
+			const int x1 = std::min(x0[x] + 1, input.cols - 1);
+			const float top = r0[x0[x]] + ax[x] * (r0[x1] - r0[x0[x]]);
+			const float bottom = r1[x0[x]] + ax[x] * (r1[x1] - r1[x0[x]]);
+			out[x] = top + ay * (bottom - top);
+		}
+	}
+	return dst;
+}
+
+const char* kernel_isa()
+{
+#if defined(__AVX2__)
+	return "avx2";
+#elif defined(__SSE4_1__)
+	return "sse4.1";
+#else
+	return "scalar";
+#endif
+}
+
+cv::Mat warp_low_res_luma(const cv::Mat& source, const cv::Mat& M, const cv::Size crop_size, const float rate)
+{
+	CV_Assert(source.type() == CV_8UC3);
+	const cv::Size size(cv::saturate_cast<int>(crop_size.width * static_cast<double>(rate)),
+		cv::saturate_cast<int>(crop_size.height * static_cast<double>(rate)));
+
+	// центр пикселя уменьшенной сетки -> координата кропа, как в linear_tap(), и дальше в source
+	const double scale = 1.0 / rate;
+	const cv::Mat to_crop = (cv::Mat_<double>(3, 3) << scale, 0, 0.5 * scale - 0.5, 0, scale, 0.5 * scale - 0.5, 0, 0, 1);
+	cv::Mat bgr;
+	cv::warpPerspective(source, bgr, M.inv() * to_crop, size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP,
+		cv::BORDER_REPLICATE);
+
+	cv::Mat Y(size, CV_32F);
+	for (int y = 0; y < size.height; y++)
+	{
+		const uchar* p = bgr.ptr<uchar>(y);
+		float* out = Y.ptr<float>(y);
+		for (int x = 0; x < size.width; x++)
 		{
-			cv::imwrite(path.string() + "if_t=50.jpg", G_);
+			out[x] = static_cast<float>(bgr_luma(p + 3 * x));
 		}
 	}
-	cv::Mat output_;
+	return Y;
+}
 
-	// lim(t→∞) (I(x, y)/ G(x,y,t)) * l, l - коэффициент для изменения яркости выходного изображения, I(x, y) - оригинальное изображение
-	output_ = 0.875 * Original / G_ * 255;
-	output_.convertTo(output_, CV_8UC1);
-	return output_;
+// Итоговая коррекция за один проход: новый Y' = Y * brightness * 255 / G (или Y * gain при if_low_res), и так как
+// Cr и Cb не меняются, а в обратном преобразовании Y входит в B, G, R с коэффициентом 1,
+// BGR пишется сразу как c + (Y' - Y) без промежуточного YCrCb.
+static void apply_luma(const cv::Mat& input, const cv::Mat& factor, const WaterFillingParams& params,
+	cv::Mat& output)
+{
+	const bool is_gain = params.if_low_res;
+	const float scale = params.brightness * 255;
+	for_each_band(0, input.rows, params.threads, [&](const int y0, const int y1, int) {
+		for (int y = y0; y < y1; y++)
+		{
+			const uchar* src = input.ptr<uchar>(y);
+			const float* f = factor.ptr<float>(y);
+			uchar* dst = output.ptr<uchar>(y);
+			for (int x = 0; x < input.cols; x++)
+			{
+				const uchar* p = src + 3 * x;
+				const int Y = bgr_luma(p);
+				const float Y_new = is_gain ? Y * f[x] : Y * scale / f[x];
+				const int d = cv::saturate_cast<uchar>(Y_new) - Y;
+				for (int c = 0; c < 3; c++)
+				{
+					dst[3 * x + c] = cv::saturate_cast<uchar>(p[c] + d);
+				}
+			}
+		}
+	});
 }
 
-cv::Mat removeShadowWaterFilling(const cv::Mat& input, float rate, const fs::path& path) {
-	// Перевод из BGR в YCrCb
-	cv::Mat img_YCrCb;
-	cv::cvtColor(input, img_YCrCb, cv::COLOR_BGR2YCrCb);
+ShadowRemovalEngine::ShadowRemovalEngine(const WaterFillingParams& params)
+	: params_(params), buffers_(std::make_unique<Buffers>())
+{
+}
 
-	// Разделение на каналы: [0]=Y, [1]=Cr, [2]=Cb
-	cv::Mat chan[3];
-	split(img_YCrCb, chan);
+ShadowRemovalEngine::~ShadowRemovalEngine() = default;
+
+cv::Mat ShadowRemovalEngine::process(const cv::Mat& input, const float rate, const fs::path& path, SolverStats* stats)
+{
+	Buffers& b = *buffers_;
+	StageTimer timer;
+	CV_Assert(input.type() == CV_8UC3);
 
-	// сохранение оригинала
-	cv::Mat Y = chan[0];
-	const cv::Mat original_Y = chan[0].clone();
+	// Y сразу из BGR и уменьшение в один проход
+	const cv::Mat Y = low_res_luma(input, rate, b.luma_row, b.Y_down);
+	const StageTime downsample_time = timer.lap();
+	cv::Mat output = process(input, Y, path, stats);
+	if (stats)
+	{
+		stats->downsample_time = downsample_time;
+	}
+	return output;
+}
 
-	// downsample
-	downsample(Y, Y, rate);
+cv::Mat ShadowRemovalEngine::process(const cv::Mat& input, const cv::Mat& Y, const fs::path& path, SolverStats* stats)
+{
+	Buffers& b = *buffers_;
+	StageTimer timer;
+	SolverStats unused;
+	SolverStats& st = stats ? *stats : unused;
+	CV_Assert(input.type() == CV_8UC3 && Y.type() == CV_32F);
+	st.downsample_time = StageTime{};
+	if (params_.tile_size > 0)
+	{
+		return process_tiled(input, Y, path, st);
+	}
 
 	// Обработка яркостного канала (Y)
+	cv::Mat factor;
+	const bool is_gain = params_.if_low_res;
+	if (is_gain)
+	{
+		// оба этапа на уменьшенной сетке, увеличивается только карта усиления
+		const cv::Mat G8 = upscale(flood_and_effuse(Y, path, params_, &st, b.solver), Y.size(), b.solver);
+		st.wf_time = timer.lap();
+		const cv::Mat gain = incre_gain_low_res(G8, input.size(), path, params_, &st, b.solver);
+		st.if_time = timer.lap();
+		factor = fit(b.solver.if_gain_up, input.size(), CV_32F);
+		cv::resize(gain, factor, input.size(), 0, 0, cv::INTER_LINEAR);
+		st.upsample_time = timer.lap();
+	} else
+	{
+		// Flood and Effuse
+		cv::Mat G_ = flood_and_effuse(Y, path, params_, &st, b.solver);
+		st.wf_time = timer.lap();
 
-	// Flood and Effuse and Upscale
-	cv::Mat G_ = water_filling(Y, original_Y.size(), path);
+		// Upscale
+		G_ = upscale(G_, input.size(), b.solver);
+		st.upsample_time = timer.lap();
 
-	// Incremental Filling of Catchment Basins
-	G_ = incre_filling(G_, original_Y, path);
+		// Incremental Filling of Catchment Basins: G, деление на него - в apply_luma
+		factor = incre_diffusion(G_, params_.if_iterations, path, params_, &st, b.solver);
+		st.if_time = timer.lap();
+	}
 
-	// Объединение каналов
-	std::vector<cv::Mat> channels_(3);
-	channels_[0] = G_;        // Новый Y
-	channels_[1] = chan[1];   // Cr
-	channels_[2] = chan[2];   // Cb
+	// Новый Y и сразу BGR
+	cv::Mat output = fit(b.output, input.size(), CV_8UC3);
+	apply_luma(input, factor, params_, output);
+	st.merge_time = timer.lap();
 
-	cv::Mat YCrCb_output;
-	merge(channels_, YCrCb_output);
+	return output;
+}
 
-	// Обратно в BGR
-	cv::Mat output;
-	cv::cvtColor(YCrCb_output, output, cv::COLOR_YCrCb2BGR);
+cv::Mat ShadowRemovalEngine::process_tiled(const cv::Mat& input, const cv::Mat& Y, const fs::path& path,
+	SolverStats& st)
+{
+	Buffers& b = *buffers_;
+	StageTimer timer;
+	const cv::Size full = input.size();
 
+	// Оценка освещённости целиком на уменьшенной сетке (она мала)
+	const cv::Mat wf_G = flood_and_effuse(Y, path, params_, &st, b.solver);
+	const cv::Mat G_low = fit(b.G_low, wf_G.size(), CV_32F);
+	wf_G.copyTo(G_low);
+	st.wf_time = timer.lap();
+
+	// incre_filling по тайлам: итерации локальны, поэтому тайл с полем halo > числа итераций
+	// (плюс две неподвижные строки/столбца у края поля) даёт внутри те же значения, что и вся сетка.
+	// Порог и тёплый старт глобальны, снимки на тайлах не нужны - отключаются.
+	WaterFillingParams tile_params = params_;
+	tile_params.if_tolerance = 0;
+	tile_params.warm_start = false;
+	tile_params.snapshot_sink = nullptr;
+
+	cv::Mat gain_low;
+	int halo = 0;
+	if (params_.if_low_res)
+	{
+		// карта усиления целиком на уменьшенной сетке, по тайлам только увеличивается
+		const cv::Mat G8 = upscale(G_low, G_low.size(), b.solver);
+		gain_low = incre_gain_low_res(G8, full, path, tile_params, &st, b.solver);
+		st.if_time = timer.lap();
+	} else
+	{
+		halo = params_.if_iterations + DiffuseRule::Border::hi;
+		// у неявного решателя прогонка связывает всю строку и столбец, поле его не ограничивает:
+		// на тайлах он дал бы швы, поэтому по тайлам всегда явные итерации
+		tile_params.if_solver = IfSolver::Explicit;
+	}
+
+	cv::Mat output = fit(b.output, full, CV_8UC3);
+	const int tile = params_.tile_size;
+	for (int ty = 0; ty < full.height; ty += tile)
+	{
+		for (int tx = 0; tx < full.width; tx += tile)
+		{
+			const cv::Rect inner(tx, ty, std::min(tile, full.width - tx), std::min(tile, full.height - ty));
+			const cv::Rect outer = cv::Rect(tx - halo, ty - halo, inner.width + 2 * halo, inner.height + 2 * halo)
+				& cv::Rect(cv::Point(0, 0), full);
+			const cv::Rect local(inner.tl() - outer.tl(), inner.size());
+
+			cv::Mat factor;
+			if (params_.if_low_res)
+			{
+				factor = resize_window(gain_low, full, inner, b.tile_G);
+				st.upsample_time += timer.lap();
+			} else
+			{
+				// upscale G на тайл с полем, как у upscale(): float -> CV_8U
+				const cv::Mat G_up = resize_window(G_low, full, outer, b.tile_G);
+				cv::Mat G8 = fit(b.tile_G8, outer.size(), CV_8U);
+				G_up.convertTo(G8, CV_8UC1);
+				st.upsample_time += timer.lap();
+
+				factor = incre_diffusion(G8, params_.if_iterations, path, tile_params, &st, b.solver)(local);
+				st.if_time += timer.lap();
+			}
+
+			cv::Mat out_tile = output(inner);
+			apply_luma(input(inner), factor, params_, out_tile);
+			st.merge_time += timer.lap();
+		}
+	}
 	return output;
 }
+
+cv::Mat removeShadowWaterFilling(const cv::Mat& input, float rate, const fs::path& path,
+	const WaterFillingParams& params, SolverStats* stats) {
+	// результат держит свой буфер и после уничтожения движка
+	ShadowRemovalEngine engine(params);
+	return engine.process(input, rate, path, stats);
+}
+
+// Пакет сеток одного решателя, уложенных друг под другом в одну плоскость (ширина - наибольшая).
+// Неподвижные строки и столбцы каждой сетки отделяют её от соседних, поэтому ядро, обновляя
+// сетку, читает только её клетки.
+struct BatchWorkspace {
+	cv::Mat G_cur, G_prev;
+	std::vector<int> row_grid; // сетка строки или -1, если строку ядро не обновляет
+	std::vector<float> row_max;
+	std::vector<float> row_residual;
+	std::vector<float> G_peak;
+	std::vector<float> border_max;
+};
+
+// Итерации правила rule над пакетом: сетка i занимает rects[i] в src и w_ и делает до
+// max_iterations[i] итераций или до порога tolerance. Сетка, которая закончила, больше не
+// обновляется, её G (как ws.G_prev у stencil_iterations()) копируется в G[i].
+// Возвращает число итераций каждой сетки.
+template <class T, class Rule>
+static std::vector<int> batched_iterations(const cv::Mat& src, cv::Mat& w_, const std::vector<cv::Rect>& rects,
+	const Rule& rule, const std::vector<int>& max_iterations, const float tolerance,
+	const WaterFillingParams& params, BatchWorkspace& ws, std::vector<cv::Mat>& G)
+{
+	using Border = typename Rule::Border;
+	const size_t n = rects.size();
+	const int H = src.rows;
+
+	ws.G_cur.create(src.size(), cv_depth<T>());
+	ws.G_prev.create(src.size(), cv_depth<T>());
+	for (int y = 0; y < H; y++)
+	{
+		const T* w_row = w_.ptr<T>(y);
+		const T* s_row = src.ptr<T>(y);
+		T* g_row = ws.G_cur.ptr<T>(y);
+		for (int x = 0; x < src.cols; x++)
+		{
+			g_row[x] = store_value<T>(load_value(w_row[x]) + load_value(s_row[x]));
+		}
+	}
+	ws.G_cur.copyTo(ws.G_prev);
+
+	ws.row_grid.assign(H, -1);
+	ws.row_max.assign(H, 0.f);
+	ws.row_residual.assign(H, 0.f);
+	ws.G_peak.assign(n, -std::numeric_limits<float>::max());
+	ws.border_max.assign(n, -std::numeric_limits<float>::max());
+	for (size_t i = 0; i < n; i++)
+	{
+		const cv::Rect& r = rects[i];
+		for (int y = 0; y < r.height; y++)
+		{
+			const T* g_row = ws.G_cur.ptr<T>(r.y + y);
+			const bool fixed_row = y < Border::lo || y >= r.height - Border::hi;
+			if (!fixed_row)
+			{
+				ws.row_grid[r.y + y] = static_cast<int>(i);
+			}
+			for (int x = 0; x < r.width; x++)
+			{
+				const float g = load_value(g_row[x]);
+				ws.G_peak[i] = std::max(ws.G_peak[i], g);
+				if (fixed_row || x < Border::lo || x >= r.width - Border::hi)
+				{
+					ws.border_max[i] = std::max(ws.border_max[i], g);
+				}
+			}
+		}
+	}
+
+	const auto finish = [&](const size_t i) {
+		ws.G_prev(rects[i]).convertTo(G[i], CV_32F, std::is_same_v<T, float> ? 1.0 : 1.0 / q8_scale);
+	};
+	std::vector<int> done(n, 0);
+	std::vector<char> active(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		active[i] = max_iterations[i] > 0;
+		if (!active[i])
+		{
+			finish(i);
+		}
+	}
+
+	using RowUpdate = decltype(rule.template row<T>(0, 0.f));
+	std::vector<RowUpdate> updates;
+	for (int t = 0; std::find(active.begin(), active.end(), 1) != active.end(); t++)
+	{
+		updates.clear();
+		for (size_t i = 0; i < n; i++)
+		{
+			updates.push_back(rule.template row<T>(t, ws.G_peak[i]));
+		}
+
+		// одна итерация всех незакончивших сеток за один проход полос
+		for_each_band(0, H, params.threads, [&](const int y0, const int y1, int) {
+			for (int y = y0; y < y1; y++)
+			{
+				const int i = ws.row_grid[y];
+				if (i < 0 || !active[i])
+				{
+					continue;
+				}
+				float g_max = -std::numeric_limits<float>::max();
+				ws.row_residual[y] = updates[i](ws.G_cur.ptr<T>(y - 1), ws.G_cur.ptr<T>(y), ws.G_cur.ptr<T>(y + 1),
+					src.ptr<T>(y), w_.ptr<T>(y), ws.G_prev.ptr<T>(y), Border::lo, rects[i].width - Border::hi, g_max);
+				ws.row_max[y] = g_max;
+			}
+		});
+		std::swap(ws.G_cur, ws.G_prev);
+
+		for (size_t i = 0; i < n; i++)
+		{
+			if (!active[i])
+			{
+				continue;
+			}
+			const cv::Rect& r = rects[i];
+			float residual = 0;
+			float g_max = ws.border_max[i];
+			for (int y = r.y + Border::lo; y < r.y + r.height - Border::hi; y++)
+			{
+				residual = std::max(residual, ws.row_residual[y]);
+				g_max = std::max(g_max, ws.row_max[y]);
+			}
+			ws.G_peak[i] = g_max;
+			done[i]++;
+			if (done[i] == max_iterations[i] || (tolerance > 0 && residual < tolerance))
+			{
+				active[i] = 0;
+				finish(i);
+			}
+		}
+	}
+	return done;
+}
+
+// Пакет плоскостей planes (float) в одну плоскость типа хранения T и итерации от w = 0.
+// G[i] - результат для planes[i], bytes[i] - оценка трафика одной её итерации.
+template <class T, class Rule>
+static std::vector<int> batched_solve(const std::vector<cv::Mat>& planes, const Rule& rule,
+	const std::vector<int>& max_iterations, const float tolerance, const WaterFillingParams& params,
+	std::vector<cv::Mat>& G, std::vector<double>& bytes)
+{
+	std::vector<cv::Rect> rects;
+	int width = 0;
+	int height = 0;
+	for (const cv::Mat& p : planes)
+	{
+		rects.emplace_back(0, height, p.cols, p.rows);
+		height += p.rows;
+		width = std::max(width, p.cols);
+	}
+
+	cv::Mat src(height, width, cv_depth<T>());
+	cv::Mat w_(height, width, cv_depth<T>());
+	src.setTo(0);
+	w_.setTo(0);
+	bytes.resize(planes.size());
+	for (size_t i = 0; i < planes.size(); i++)
+	{
+		cv::Mat dst = src(rects[i]);
+		planes[i].convertTo(dst, cv_depth<T>(), std::is_same_v<T, float> ? 1.0 : q8_scale);
+		bytes[i] = plain_iteration_bytes(dst);
+	}
+
+	BatchWorkspace ws;
+	G.resize(planes.size());
+	return batched_iterations<T>(src, w_, rects, rule, max_iterations, tolerance, params, ws, G);
+}
+
+template <class T>
+static std::vector<cv::Mat> remove_shadow_batch(const std::vector<cv::Mat>& inputs, const float rate,
+	const WaterFillingParams& params, std::vector<SolverStats>& st)
+{
+	const size_t n = inputs.size();
+	StageTimer timer;
+	StageTime downsample_time, wf_time, if_time, upsample_time, merge_time;
+
+	// Y каждого изображения сразу в уменьшенном размере
+	cv::Mat luma_row[2];
+	std::vector<cv::Mat> Y_buf(n), Y(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		CV_Assert(inputs[i].type() == CV_8UC3);
+		Y[i] = low_res_luma(inputs[i], rate, luma_row, Y_buf[i]);
+	}
+	downsample_time = timer.lap();
+
+	// water_filling всего пакета
+	std::vector<cv::Mat> G;
+	std::vector<double> wf_bytes;
+	const std::vector<int> wf_done = batched_solve<T>(Y, FloodRule{params.kernel, params.neta},
+		std::vector<int>(n, params.wf_iterations), params.wf_tolerance, params, G, wf_bytes);
+	wf_time = timer.lap();
+
+	// вход incre_filling - G water_filling в CV_8U, как у upscale(); в исходном размере
+	// или (if_low_res) на уменьшенной сетке с числом итераций, масштабированным на rate²
+	SolverBuffers b;
+	std::vector<cv::Mat> if_input(n);
+	std::vector<int> if_iterations(n, params.if_iterations);
+	for (size_t i = 0; i < n; i++)
+	{
+		const cv::Size size = params.if_low_res ? Y[i].size() : inputs[i].size();
+		upscale(G[i], size, b).convertTo(if_input[i], CV_32F);
+		if (params.if_low_res)
+		{
+			const double area_ratio = static_cast<double>(Y[i].total()) / std::max(inputs[i].size().area(), 1);
+			if_iterations[i] = std::max(1, cvRound(params.if_iterations * area_ratio));
+		}
+	}
+	upsample_time = timer.lap();
+
+	std::vector<double> if_bytes(n);
+	std::vector<int> if_done(n);
+	if (params.if_solver == IfSolver::Adi)
+	{
+		// несколько неявных шагов на изображение: накладных расходов итераций здесь нет
+		for (size_t i = 0; i < n; i++)
+		{
+			SolverStats adi_stats;
+			G[i] = incre_adi(if_input[i], if_iterations[i], params, &adi_stats, b).clone();
+			if_done[i] = adi_stats.if_iterations;
+			if_bytes[i] = adi_stats.if_bytes_per_iteration;
+		}
+	} else
+	{
+		if_done = batched_solve<T>(if_input, DiffuseRule{params.neta}, if_iterations, params.if_tolerance, params,
+			G, if_bytes);
+	}
+	if_time = timer.lap();
+
+	std::vector<cv::Mat> outputs(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		cv::Mat factor;
+		if (params.if_low_res)
+		{
+			cv::Mat gain;
+			cv::divide(params.brightness * 255.0, G[i], gain);
+			cv::resize(gain, factor, inputs[i].size(), 0, 0, cv::INTER_LINEAR);
+		} else
+		{
+			factor = G[i];
+		}
+		outputs[i].create(inputs[i].size(), CV_8UC3);
+		apply_luma(inputs[i], factor, params, outputs[i]);
+	}
+	merge_time = timer.lap();
+
+	for (size_t i = 0; i < n; i++)
+	{
+		st[i].wf_iterations = wf_done[i];
+		st[i].wf_bytes_per_iteration = wf_bytes[i];
+		st[i].if_iterations = if_done[i];
+		st[i].if_bytes_per_iteration = if_bytes[i];
+		st[i].downsample_time = downsample_time;
+		st[i].wf_time = wf_time;
+		st[i].upsample_time = upsample_time;
+		st[i].if_time = if_time;
+		st[i].merge_time = merge_time;
+	}
+	return outputs;
+}
+
+std::vector<cv::Mat> removeShadowWaterFilling(const std::vector<cv::Mat>& inputs, const float rate,
+	const WaterFillingParams& params, std::vector<SolverStats>* stats)
+{
+	std::vector<SolverStats> unused;
+	std::vector<SolverStats>& st = stats ? *stats : unused;
+	st.assign(inputs.size(), SolverStats{});
+
+	// пирамида, тёплый старт, тайлы и снимки - по одному изображению
+	if (params.wf_levels > 1 || params.warm_start || params.tile_size > 0 || params.snapshot_sink)
+	{
+		std::vector<cv::Mat> outputs;
+		ShadowRemovalEngine engine(params);
+		for (size_t i = 0; i < inputs.size(); i++)
+		{
+			outputs.push_back(engine.process(inputs[i], rate, fs::path(), &st[i]).clone());
+		}
+		return outputs;
+	}
+	if (params.precision == StatePrecision::Q8_8)
+	{
+		return remove_shadow_batch<uint16_t>(inputs, rate, params, st);
+	}
+	return remove_shadow_batch<float>(inputs, rate, params, st);
+}
@@ -4,17 +4,175 @@
 
 #include <opencv2/opencv.hpp>
 #include <vector>
+#include <memory>
 #include <fstream>
 #include <nlohmann/json.hpp>
 #include <iostream>
 #include <opencv2/ximgproc/edge_filter.hpp>
+#include "stage_timer.h"
 
 namespace fs = std::filesystem;
 
 #ifndef WATER_FILLING_H
-cv::Mat water_filling(const cv::Mat& src, cv::Size original_size, const fs::path& path);
-cv::Mat incre_filling(cv::Mat input, cv::Mat Original, const fs::path& path);
-cv::Mat removeShadowWaterFilling(const cv::Mat& input, float rate, const fs::path& path);
+
+// Ядро flood/effuse в water_filling():
+// Scalar - эталонная попиксельная реализация (double),
+// Simd   - векторизованная построчная реализация (float, AVX2/SSE4.1).
+// Simd отличается от Scalar не более чем на 1 уровень яркости после перевода в CV_8U.
+enum class WfKernel { Scalar, Simd };
+
+// Набор инструкций, с которым собраны ядра Simd: "avx2", "sse4.1" или "scalar" (см. CW_ENABLE_AVX2)
+const char* kernel_isa();
+
+// Хранение состояния решателей (src, w, G):
+// F32  - CV_32F,
+// Q8_8 - фиксированная точка в CV_16U (значение * 256, шаг 1/256), вдвое меньше трафика памяти.
+// Значения G не выходят за [0, 255], поэтому диапазона Q8.8 хватает. Вычисления всегда во float,
+// эталонное ядро WfKernel::Scalar есть только для F32.
+enum class StatePrecision { F32, Q8_8 };
+
+// Решатель incre_filling:
+// Explicit - if_iterations явных шагов диффузии с шагом neta (исходный алгоритм),
+// Adi      - то же время диффузии neta * if_iterations за if_adi_steps неявных шагов с расщеплением
+//            по осям (прогонка по строкам, затем по столбцам) и проекцией на w >= 0.
+enum class IfSolver { Explicit, Adi };
+
+struct SnapshotSink; // snapshot_sink.h
+
+struct WaterFillingParams {
+	WfKernel kernel = WfKernel::Simd;
+	StatePrecision precision = StatePrecision::F32;
+	// число полос, на которые делится сетка на каждой итерации (1 - последовательно);
+	// результат не зависит от числа потоков
+	int threads = 1;
+
+	// шаг растекания/диффузии neta и коэффициент яркости результата l (I / G · l · 255);
+	// правило обновления, соседство и тип хранения выбираются при компиляции, эти - во время работы
+	float neta = 0.2f;
+	float brightness = 0.875f;
+
+	// максимальное число итераций
+	int wf_iterations = 2500;
+	int if_iterations = 100;
+	// if_iterations задаёт время диффузии; у Adi порог, тёплый старт, снимки и precision
+	// не применяются, каждый шаг стоит порядка четырёх явных итераций. Полноразмерный
+	// incre_filling по тайлам (tile_size) всегда явный: Adi не локален.
+	IfSolver if_solver = IfSolver::Explicit;
+	int if_adi_steps = 8;
+	// остановка, когда max |Δw| за итерацию меньше порога (0 - всегда полное число итераций)
+	float wf_tolerance = 0;
+	float if_tolerance = 0;
+
+	// Пирамида для water_filling: число уровней (1 - без пирамиды).
+	// Грубый уровень выполняет до wf_iterations итераций, каждый следующий
+	// стартует с увеличенного w_ и делает до wf_refine_iterations.
+	int wf_levels = 1;
+	int wf_refine_iterations = 200;
+
+	// incre_filling на той же уменьшенной сетке, что и water_filling: в исходный размер
+	// увеличивается только итоговая карта усиления. if_iterations масштабируется на rate²,
+	// чтобы диффузия охватывала ту же область исходного изображения.
+	bool if_low_res = false;
+
+	// Тёплый старт для последовательных кадров одной страницы (ShadowRemovalEngine):
+	// если прошлый вызов был для изображения того же размера, w_ water_filling и incre_filling
+	// берутся из его решения. Налив и пирамида пропускаются, water_filling делает не более
+	// wf_warm_iterations итераций растекания, incre_filling - не более if_warm_iterations.
+	bool warm_start = false;
+	int wf_warm_iterations = 100;
+	int if_warm_iterations = 10;
+
+	// Тайловый режим для очень больших сканов (0 - выключен): оценка освещённости считается
+	// целиком на уменьшенной сетке, а incre_filling, объединение каналов и перевод в BGR -
+	// по тайлам tile_size x tile_size с полем if_iterations + 2. Кроме входа и результата
+	// полноразмерных плоскостей нет, память на тайл ограничена. Стыки тайлов совпадают с
+	// расчётом на всей сетке; if_tolerance в этом режиме не применяется.
+	int tile_size = 0;
+
+	// Временная блокировка: сколько итераций подряд выполняется на полосе строк,
+	// помещающейся в cache_bytes (1 - выключено). Результат совпадает с обычными итерациями;
+	// в water_filling включается после окончания налива, когда e^-t обращается в 0.
+	int time_block = 1;
+	size_t cache_bytes = 1 << 20;
+
+	// Промежуточные снимки G: итерации water_filling/incre_filling и приёмник
+	// (nullptr - снимки не делаются, решатель не тратит на них время).
+	// Файлы получают префикс path, переданный в решатель.
+	SnapshotSink* snapshot_sink = nullptr;
+	std::vector<int> wf_snapshot_iterations{100, 1500};
+	std::vector<int> if_snapshot_iterations{10, 50};
+};
+
+// Фактически выполненная работа
+struct SolverStats {
+	int wf_iterations = 0;        // на уровне исходного разрешения
+	int wf_coarse_iterations = 0; // суммарно на грубых уровнях пирамиды
+	int if_iterations = 0;
+	// оценка трафика памяти на одну итерацию, байт
+	double wf_bytes_per_iteration = 0;
+	double if_bytes_per_iteration = 0;
+
+	// время этапов ShadowRemovalEngine::process(): Y из BGR с уменьшением, water_filling,
+	// incre_filling, увеличение до исходного размера, новый Y и BGR за один проход
+	StageTime downsample_time;
+	StageTime wf_time;
+	StageTime if_time;
+	StageTime upsample_time;
+	StageTime merge_time;
+};
+
+cv::Mat water_filling(const cv::Mat& src, cv::Size original_size, const fs::path& path,
+	const WaterFillingParams& params = {}, SolverStats* stats = nullptr);
+cv::Mat incre_filling(cv::Mat input, cv::Mat Original, const fs::path& path,
+	const WaterFillingParams& params = {}, SolverStats* stats = nullptr);
+cv::Mat removeShadowWaterFilling(const cv::Mat& input, float rate, const fs::path& path,
+	const WaterFillingParams& params = {}, SolverStats* stats = nullptr);
+
+// Пакет небольших изображений (чеки, этикетки), у которых уменьшенная сетка - несколько тысяч
+// пикселей и время уходит на накладные расходы итераций, а не на сами клетки. Сетки всех
+// изображений укладываются друг под другом в одну плоскость, и итерация water_filling и
+// incre_filling - один проход полос по ней. ˆh, порог остановки и число итераций у каждого
+// изображения свои, результат совпадает с removeShadowWaterFilling() для каждого по отдельности.
+// time_block в пакете не применяется; с пирамидой, тёплым стартом, тайлами или снимками
+// изображения обрабатываются по одному. Время этапов в (*stats)[i] - общее для пакета.
+std::vector<cv::Mat> removeShadowWaterFilling(const std::vector<cv::Mat>& inputs, float rate,
+	const WaterFillingParams& params = {}, std::vector<SolverStats>* stats = nullptr);
+
+// Вход решателя для кропа, который получается из source перспективным преобразованием M
+// (source -> кроп размера crop_size, как у cv::warpPerspective): Y (CV_32F) сразу на уменьшенной
+// сетке rate, без прохода по полноразмерному кропу. Сетка и центры пикселей - как у уменьшения
+// в ShadowRemovalEngine::process(), выборка билинейная; source интерполируется один раз, а не
+// дважды (кроп, затем уменьшение), поэтому значения могут отличаться на доли уровня.
+cv::Mat warp_low_res_luma(const cv::Mat& source, const cv::Mat& M, cv::Size crop_size, float rate);
+
+// Удаление тени для списка изображений. Все промежуточные плоскости (уменьшенный Y, w_ и G_
+// обоих решателей, карта усиления и выходное изображение) принадлежат движку и переиспользуются;
+// буферы растут только на изображении большего размера, поэтому пакет одинаковых
+// сканов обрабатывается почти без выделений памяти.
+// Результат process() указывает в буфер движка и действителен до следующего вызова.
+class ShadowRemovalEngine {
+public:
+	explicit ShadowRemovalEngine(const WaterFillingParams& params = {});
+	~ShadowRemovalEngine();
+	ShadowRemovalEngine(const ShadowRemovalEngine&) = delete;
+	ShadowRemovalEngine& operator=(const ShadowRemovalEngine&) = delete;
+
+	cv::Mat process(const cv::Mat& input, float rate, const fs::path& path, SolverStats* stats = nullptr);
+	// То же по готовому уменьшенному Y (CV_32F, например warp_low_res_luma()): input нужен
+	// только итоговой коррекции цвета, rate определяется размером Y
+	cv::Mat process(const cv::Mat& input, const cv::Mat& Y, const fs::path& path, SolverStats* stats = nullptr);
+
+	const WaterFillingParams& params() const { return params_; }
+	// Буферы от параметров не зависят: смена параметров между вызовами ничего не перевыделяет
+	void set_params(const WaterFillingParams& params) { params_ = params; }
+
+private:
+	cv::Mat process_tiled(const cv::Mat& input, const cv::Mat& Y, const fs::path& path, SolverStats& stats);
+
+	struct Buffers;
+	WaterFillingParams params_;
+	std::unique_ptr<Buffers> buffers_;
+};
 #define WATER_FILLING_H
 
 #endif //WATER_FILLING_H